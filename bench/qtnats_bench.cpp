@@ -0,0 +1,490 @@
+/* Copyright(c) 2022 Petro Kazmirchuk https://github.com/Kazmirchuk
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with the License.You may obtain a copy of the License at http ://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.See the License for the specific language governing permissions and  limitations under the License.
+*/
+
+// End-to-end throughput and latency benchmark in the spirit of "nats bench", e.g.:
+// qtnats-bench pubsub --msgs=1000000 --size=128 --pubs=2 --subs=4 --format=json
+
+#include <qtnats.h>
+
+#include <iostream>
+#include <vector>
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+
+using namespace std;
+using namespace QtNats;
+
+namespace {
+
+struct BenchConfig
+{
+    QString scenario;
+    QUrl server;
+    QByteArray subject;
+    QByteArray stream;
+    int messages = 0;
+    int size = 0;
+    int publishers = 0;
+    int subscribers = 0;
+    int batch = 0;
+    qint64 timeout = 0;
+    QString format;
+};
+
+struct Result
+{
+    QString role;
+    int clients = 0;
+    quint64 messages = 0;
+    quint64 bytes = 0;
+    double seconds = 0;
+    LatencyHistogram latency; // only for request/reply and sync JetStream publishing
+
+    double messageRate() const { return seconds > 0 ? messages / seconds : 0; }
+    double megabytesRate() const { return seconds > 0 ? bytes / seconds / (1024 * 1024) : 0; }
+};
+
+// splits "total" as evenly as possible between "parts"
+int share(int total, int parts, int index)
+{
+    return total / parts + (index < total % parts ? 1 : 0);
+}
+
+// runs job(index) in "count" threads in parallel and waits for all of them
+template<typename Job>
+void runInThreads(int count, Job job)
+{
+    std::vector<std::unique_ptr<QThread>> threads;
+    for (int i = 0; i < count; i++) {
+        threads.emplace_back(QThread::create([job, i]() { job(i); }));
+        threads.back()->start();
+    }
+    for (auto& t : threads) {
+        t->wait();
+    }
+}
+
+// waits until "received" stops growing for "timeout" ms or reaches "expected"
+void waitForCount(const std::atomic<quint64>& received, quint64 expected, qint64 timeout)
+{
+    QElapsedTimer idle;
+    idle.start();
+    quint64 last = received;
+    while (received < expected && idle.elapsed() < timeout) {
+        QThread::msleep(1);
+        if (received != last) {
+            last = received;
+            idle.restart();
+        }
+    }
+}
+
+class Bench
+{
+public:
+    explicit Bench(const BenchConfig& config) : m_config(config), m_payload(config.size, 'x') {}
+
+    QList<Result> run();
+
+private:
+    void connect(Client& c) const { c.connectToServer(m_config.server); }
+    QByteArray jsApi(Client& c, const QByteArray& subject, const QJsonObject& request) const;
+    void createStream(Client& c) const;
+
+    Result publishers(std::function<void(Client& c, int count, Result& r)> body);
+    QList<Result> pubSub(const QByteArray& queueGroup);
+    QList<Result> requestReply();
+    QList<Result> pullConsume();
+
+    const BenchConfig m_config;
+    const QByteArray m_payload;
+};
+
+QByteArray Bench::jsApi(Client& c, const QByteArray& subject, const QJsonObject& request) const
+{
+    Message msg(subject, QJsonDocument(request).toJson(QJsonDocument::Compact));
+    Message response = c.request(msg, 5000);
+    QJsonObject error = QJsonDocument::fromJson(response.data).object().value("error").toObject();
+    if (!error.isEmpty()) {
+        cerr << subject.constData() << ": " << qPrintable(error.value("description").toString()) << endl;
+    }
+    return response.data;
+}
+
+void Bench::createStream(Client& c) const
+{
+    QJsonObject config {
+        { "name", QString::fromLatin1(m_config.stream) },
+        { "subjects", QJsonArray { QString::fromLatin1(m_config.subject) } },
+        { "storage", "memory" },
+        { "retention", "limits" },
+        { "discard", "old" },
+        { "num_replicas", 1 }
+    };
+    jsApi(c, "$JS.API.STREAM.CREATE." + m_config.stream, config);
+    jsApi(c, "$JS.API.STREAM.PURGE." + m_config.stream, QJsonObject());
+}
+
+// every publisher has its own connection and thread
+Result Bench::publishers(std::function<void(Client& c, int count, Result& r)> body)
+{
+    std::vector<Result> results(m_config.publishers);
+    QElapsedTimer timer;
+    timer.start();
+    runInThreads(m_config.publishers, [this, &results, &body](int i) {
+        Client c;
+        try {
+            connect(c);
+            int count = share(m_config.messages, m_config.publishers, i);
+            body(c, count, results[i]);
+            c.ping(); // make sure everything is flushed
+            results[i].messages = count;
+        }
+        catch (const QException& e) {
+            cerr << "Publisher " << i << ": " << e.what() << endl;
+        }
+    });
+
+    Result total;
+    total.role = "pub";
+    total.clients = m_config.publishers;
+    total.seconds = timer.nsecsElapsed() / 1e9;
+    for (const Result& r : results) {
+        total.messages += r.messages;
+        total.latency.merge(r.latency);
+    }
+    total.bytes = total.messages * m_config.size;
+    return total;
+}
+
+QList<Result> Bench::pubSub(const QByteArray& queueGroup)
+{
+    QList<Result> results;
+    std::vector<std::unique_ptr<Client>> subClients;
+    std::atomic<quint64> received { 0 };
+    QElapsedTimer firstMessage;
+    std::atomic<bool> started { false };
+
+    for (int i = 0; i < m_config.subscribers; i++) {
+        subClients.emplace_back(new Client);
+        connect(*subClients.back());
+        subClients.back()->subscribe(m_config.subject, queueGroup, [&received, &started, &firstMessage](Message&&) {
+            if (!started.exchange(true)) {
+                firstMessage.start();
+            }
+            received++;
+        });
+        subClients.back()->ping();
+    }
+
+    results += publishers([this](Client& c, int count, Result&) {
+        Message msg(m_config.subject, m_payload);
+        for (int n = 0; n < count; n++) {
+            c.publish(msg);
+        }
+    });
+
+    if (m_config.subscribers > 0) {
+        // with a queue group every message is delivered once, otherwise to every subscriber
+        quint64 expected = queueGroup.isEmpty() ? quint64(m_config.messages) * m_config.subscribers : m_config.messages;
+        waitForCount(received, expected, m_config.timeout);
+        Result sub;
+        sub.role = "sub";
+        sub.clients = m_config.subscribers;
+        sub.messages = received;
+        sub.bytes = sub.messages * m_config.size;
+        sub.seconds = started ? firstMessage.nsecsElapsed() / 1e9 : 0;
+        results += sub;
+    }
+    return results;
+}
+
+QList<Result> Bench::requestReply()
+{
+    std::vector<std::unique_ptr<Client>> responders;
+    for (int i = 0; i < qMax(1, m_config.subscribers); i++) {
+        responders.emplace_back(new Client);
+        Client* c = responders.back().get();
+        connect(*c);
+        c->subscribe(m_config.subject, "qtnats-bench", [this, c](Message&& request) {
+            c->publish(Message(request.reply, m_payload));
+        });
+        c->ping();
+    }
+
+    Result r = publishers([this](Client& c, int count, Result& r) {
+        Message msg(m_config.subject, m_payload);
+        QElapsedTimer timer;
+        for (int n = 0; n < count; n++) {
+            timer.start();
+            c.request(msg, m_config.timeout);
+            r.latency.record(timer.nsecsElapsed());
+        }
+    });
+    r.role = "req";
+    return QList<Result>() << r;
+}
+
+QList<Result> Bench::pullConsume()
+{
+    QList<Result> results;
+    Client admin;
+    connect(admin);
+    createStream(admin);
+
+    const QByteArray consumer = "QTNATS_BENCH";
+    QJsonObject config {
+        { "stream_name", QString::fromLatin1(m_config.stream) },
+        { "config", QJsonObject {
+            { "durable_name", QString::fromLatin1(consumer) },
+            { "ack_policy", "none" },
+            { "deliver_policy", "all" }
+        }}
+    };
+    jsApi(admin, "$JS.API.CONSUMER.DURABLE.CREATE." + m_config.stream + "." + consumer, config);
+
+    // fill the stream first
+    results += publishers([this](Client& c, int count, Result&) {
+        JetStream* js = c.jetStream();
+        Message msg(m_config.subject, m_payload);
+        for (int n = 0; n < count; n++) {
+            js->asyncPublish(msg);
+        }
+        js->waitForPublishCompleted();
+    });
+
+    std::atomic<quint64> consumed { 0 };
+    QElapsedTimer timer;
+    timer.start();
+    runInThreads(qMax(1, m_config.subscribers), [this, &consumed, &consumer](int i) {
+        Client c;
+        try {
+            connect(c);
+            PullSubscription* sub = c.jetStream()->pullSubscribe(m_config.subject, m_config.stream, consumer);
+            while (consumed < quint64(m_config.messages)) {
+                try {
+                    consumed += sub->fetch(m_config.batch, m_config.timeout).size();
+                }
+                catch (const Exception& e) {
+                    if (e.errorCode != NATS_TIMEOUT) {
+                        throw;
+                    }
+                    break; // the stream is drained
+                }
+            }
+        }
+        catch (const QException& e) {
+            cerr << "Consumer " << i << ": " << e.what() << endl;
+        }
+    });
+
+    Result sub;
+    sub.role = "pull";
+    sub.clients = qMax(1, m_config.subscribers);
+    sub.messages = consumed;
+    sub.bytes = sub.messages * m_config.size;
+    sub.seconds = timer.nsecsElapsed() / 1e9;
+    results += sub;
+
+    jsApi(admin, "$JS.API.STREAM.DELETE." + m_config.stream, QJsonObject());
+    return results;
+}
+
+QList<Result> Bench::run()
+{
+    const QString& s = m_config.scenario;
+    if (s == "pub") {
+        return QList<Result>() << publishers([this](Client& c, int count, Result&) {
+            Message msg(m_config.subject, m_payload);
+            for (int n = 0; n < count; n++) {
+                c.publish(msg);
+            }
+        });
+    }
+    if (s == "pubsub") {
+        return pubSub(QByteArray());
+    }
+    if (s == "queue") {
+        return pubSub("qtnats-bench");
+    }
+    if (s == "reqrep") {
+        return requestReply();
+    }
+    if (s == "js-pub" || s == "js-async") {
+        Client admin;
+        connect(admin);
+        createStream(admin);
+        bool async = (s == "js-async");
+        Result r = publishers([this, async](Client& c, int count, Result& r) {
+            JetStream* js = c.jetStream();
+            Message msg(m_config.subject, m_payload);
+            QElapsedTimer timer;
+            for (int n = 0; n < count; n++) {
+                if (async) {
+                    js->asyncPublish(msg);
+                }
+                else {
+                    timer.start();
+                    js->publish(msg);
+                    r.latency.record(timer.nsecsElapsed());
+                }
+            }
+            if (async) {
+                js->waitForPublishCompleted();
+            }
+        });
+        jsApi(admin, "$JS.API.STREAM.DELETE." + m_config.stream, QJsonObject());
+        return QList<Result>() << r;
+    }
+    if (s == "js-pull") {
+        return pullConsume();
+    }
+    cerr << "Unknown scenario: " << qPrintable(s) << endl;
+    return QList<Result>();
+}
+
+const double percentiles[] = { 50, 90, 99, 99.9 };
+
+void printText(const BenchConfig& config, const QList<Result>& results)
+{
+    cout << qPrintable(config.scenario) << ": " << config.messages << " messages of " << config.size << " bytes" << endl;
+    for (const Result& r : results) {
+        cout << qPrintable(r.role) << " (" << r.clients << " clients): " << r.messages << " msgs in " << r.seconds << " s, "
+             << qint64(r.messageRate()) << " msgs/s, " << r.megabytesRate() << " MB/s" << endl;
+        if (r.latency.count()) {
+            cout << "  latency, us:";
+            for (double p : percentiles) {
+                cout << " p" << p << "=" << r.latency.percentile(p) / 1000.0;
+            }
+            cout << " max=" << r.latency.max() / 1000.0 << endl;
+        }
+    }
+}
+
+void printJson(const BenchConfig& config, const QList<Result>& results)
+{
+    QJsonArray array;
+    for (const Result& r : results) {
+        QJsonObject o {
+            { "role", r.role },
+            { "clients", r.clients },
+            { "messages", double(r.messages) },
+            { "bytes", double(r.bytes) },
+            { "seconds", r.seconds },
+            { "msgs_per_sec", r.messageRate() },
+            { "mb_per_sec", r.megabytesRate() }
+        };
+        if (r.latency.count()) {
+            QJsonObject latency;
+            for (double p : percentiles) {
+                latency.insert(QString("p%1").arg(p), r.latency.percentile(p) / 1000.0);
+            }
+            latency.insert("max", r.latency.max() / 1000.0);
+            o.insert("latency_us", latency);
+        }
+        array.append(o);
+    }
+    QJsonObject root {
+        { "scenario", config.scenario },
+        { "messages", config.messages },
+        { "size", config.size },
+        { "results", array }
+    };
+    cout << QJsonDocument(root).toJson().constData();
+}
+
+void printCsv(const BenchConfig& config, const QList<Result>& results)
+{
+    cout << "scenario,role,clients,messages,size,seconds,msgs_per_sec,mb_per_sec,p50_us,p90_us,p99_us,p99.9_us,max_us" << endl;
+    for (const Result& r : results) {
+        cout << qPrintable(config.scenario) << ',' << qPrintable(r.role) << ',' << r.clients << ',' << r.messages << ','
+             << config.size << ',' << r.seconds << ',' << r.messageRate() << ',' << r.megabytesRate();
+        for (double p : percentiles) {
+            cout << ',';
+            if (r.latency.count()) {
+                cout << r.latency.percentile(p) / 1000.0;
+            }
+        }
+        cout << ',';
+        if (r.latency.count()) {
+            cout << r.latency.max() / 1000.0;
+        }
+        cout << endl;
+    }
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qtnats-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Throughput and latency benchmark for qtnats");
+    parser.addHelpOption();
+    parser.addPositionalArgument("scenario", "pub, pubsub, queue, reqrep, js-pub, js-async or js-pull");
+    parser.addOptions({
+        { "server", "NATS server URL.", "url", "nats://localhost:4222" },
+        { "subject", "Subject to use.", "subject", "qtnats.bench" },
+        { "stream", "JetStream stream to create for js-* scenarios.", "name", "QTNATS_BENCH" },
+        { "msgs", "Total number of messages to publish.", "count", "100000" },
+        { "size", "Payload size in bytes.", "bytes", "128" },
+        { "pubs", "Number of publishers/requesters.", "count", "1" },
+        { "subs", "Number of subscribers/responders/pull consumers.", "count", "1" },
+        { "batch", "Batch size for js-pull.", "count", "100" },
+        { "timeout", "Timeout for requests, fetching and waiting for subscribers, ms.", "ms", "5000" },
+        { "format", "Output format: text, json or csv.", "format", "text" }
+    });
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1) {
+        parser.showHelp(1);
+    }
+
+    BenchConfig config;
+    config.scenario = parser.positionalArguments().first();
+    config.server = QUrl(parser.value("server"));
+    config.subject = parser.value("subject").toLatin1();
+    config.stream = parser.value("stream").toLatin1();
+    config.messages = parser.value("msgs").toInt();
+    config.size = parser.value("size").toInt();
+    config.publishers = qMax(1, parser.value("pubs").toInt());
+    config.subscribers = qMax(0, parser.value("subs").toInt());
+    config.batch = qMax(1, parser.value("batch").toInt());
+    config.timeout = parser.value("timeout").toLongLong();
+    config.format = parser.value("format");
+
+    QList<Result> results;
+    try {
+        Bench bench(config);
+        results = bench.run();
+    }
+    catch (const QException& e) {
+        cerr << "Benchmark failed: " << e.what() << endl;
+        return 1;
+    }
+    if (results.isEmpty()) {
+        return 1;
+    }
+
+    if (config.format == "json") {
+        printJson(config, results);
+    }
+    else if (config.format == "csv") {
+        printCsv(config, results);
+    }
+    else {
+        printText(config, results);
+    }
+    return 0;
+}
@@ -0,0 +1,230 @@
+/* Copyright(c) 2022 Petro Kazmirchuk https://github.com/Kazmirchuk
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with the License.You may obtain a copy of the License at http ://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.See the License for the specific language governing permissions and  limitations under the License.
+*/
+
+#include "qtnats.h"
+#include "qtnats_p.h"
+
+using namespace QtNats;
+
+ResponseMux::ResponseMux(natsConnection* conn) :
+    m_conn(conn)
+{
+    m_clock.start();
+}
+
+ResponseMux::~ResponseMux()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_wakeUp.wakeOne();
+    }
+    if (m_expireThread) {
+        m_expireThread->wait();
+        delete m_expireThread;
+    }
+    if (m_sub) {
+        // wait until the last onMessage has returned
+        if (natsSubscription_Unsubscribe(m_sub) == NATS_OK) {
+            m_subCompleted.acquire();
+        }
+        natsSubscription_Destroy(m_sub);
+    }
+    // nobody else can access m_pending now
+    for (const Entry& e : qAsConst(m_pending)) {
+        e.handler->expire(NATS_CONNECTION_CLOSED);
+    }
+    // the watchers are deleted when their thread finishes
+    m_pending.clear();
+    if (m_cancelThread) {
+        m_cancelThread->quit();
+        m_cancelThread->wait();
+        delete m_cancelThread;
+    }
+}
+
+// must be called with m_mutex locked
+void ResponseMux::start()
+{
+    m_prefix = Client::newInbox() + '.';
+    QByteArray subject = m_prefix + '*';
+    checkError(natsConnection_Subscribe(&m_sub, m_conn, subject.constData(), &onMessage, this));
+    checkError(natsSubscription_SetOnCompleteCB(m_sub, &onComplete, this));
+    // a dropped response would look like a timeout
+    checkError(natsSubscription_SetPendingLimits(m_sub, -1, -1));
+
+    m_expireThread = QThread::create([this]() { expireLoop(); });
+    m_expireThread->start();
+    m_cancelThread = new QThread();
+    m_cancelThread->start();
+}
+
+QByteArray ResponseMux::add(std::shared_ptr<ResponseHandler> handler, qint64 timeout, qint64 stallTimeout)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_sub) {
+        start();
+    }
+    QByteArray token = QByteArray::number(++m_nextToken, 36);
+    Entry e { std::move(handler), -1, -1, stallTimeout, nullptr };
+    if (QFutureWatcherBase* watcher = e.handler->watchCancel()) {
+        // connected before moving, so that a cancellation which is already posted isn't missed
+        QObject::connect(watcher, &QFutureWatcherBase::canceled, watcher, [this, token]() { canceled(token); });
+        watcher->moveToThread(m_cancelThread);
+        e.watcher.reset(watcher, [](QFutureWatcherBase* w) { w->deleteLater(); });
+    }
+    // expireLoop sleeps indefinitely when there are no pending requests
+    if (m_pending.isEmpty()) {
+        m_wakeUp.wakeOne();
+    }
+    if (timeout > 0) {
+        e.finalDeadline = m_clock.elapsed() + timeout;
+        setDeadline(token, e, e.finalDeadline);
+    }
+    m_pending.insert(token, e);
+    return m_prefix + token;
+}
+
+// must be called with m_mutex locked
+void ResponseMux::setDeadline(const QByteArray& token, Entry& e, qint64 deadline)
+{
+    if (e.deadline >= 0) {
+        m_deadlines.remove(e.deadline, token);
+    }
+    if (m_deadlines.isEmpty() || deadline < m_deadlines.firstKey()) {
+        m_wakeUp.wakeOne();
+    }
+    e.deadline = deadline;
+    m_deadlines.insert(deadline, token);
+}
+
+void ResponseMux::rearm(const QByteArray& token)
+{
+    QMutexLocker locker(&m_mutex);
+    auto it = m_pending.find(token);
+    if (it == m_pending.end() || it->stallTimeout <= 0) {
+        return;
+    }
+    qint64 deadline = m_clock.elapsed() + it->stallTimeout;
+    if (it->finalDeadline >= 0) {
+        deadline = qMin(deadline, it->finalDeadline);
+    }
+    setDeadline(token, *it, deadline);
+}
+
+void ResponseMux::remove(const QByteArray& replySubject)
+{
+    removeToken(replySubject.mid(m_prefix.size()));
+}
+
+void ResponseMux::removeToken(const QByteArray& token)
+{
+    std::shared_ptr<ResponseHandler> handler; // destroy it after unlocking
+    QMutexLocker locker(&m_mutex);
+    auto it = m_pending.find(token);
+    if (it == m_pending.end()) {
+        return;
+    }
+    if (it->deadline >= 0) {
+        m_deadlines.remove(it->deadline, token);
+    }
+    handler = std::move(it->handler);
+    m_pending.erase(it);
+}
+
+void ResponseMux::onMessage(natsConnection* /*nc*/, natsSubscription* /*sub*/, natsMsg* msg, void* closure)
+{
+    auto mux = reinterpret_cast<ResponseMux*>(closure);
+    // the subject always starts with m_prefix, because the subscription is <prefix>.*
+    QByteArray token(natsMsg_GetSubject(msg) + mux->m_prefix.size());
+
+    std::shared_ptr<ResponseHandler> handler;
+    {
+        QMutexLocker locker(&mux->m_mutex);
+        auto it = mux->m_pending.constFind(token);
+        if (it != mux->m_pending.constEnd()) {
+            handler = it->handler;
+        }
+    }
+    if (!handler) {
+        // a late response to an expired request
+        natsMsg_Destroy(msg);
+        return;
+    }
+    // the handler is called without the lock, so that it may issue new requests
+    if (handler->deliver(msg)) {
+        mux->removeToken(token);
+    }
+    else {
+        mux->rearm(token);
+    }
+}
+
+// called in m_cancelThread
+void ResponseMux::canceled(const QByteArray& token)
+{
+    QMutexLocker locker(&m_mutex);
+    m_canceled.append(token);
+    m_wakeUp.wakeOne();
+}
+
+void ResponseMux::onComplete(void* closure)
+{
+    auto mux = reinterpret_cast<ResponseMux*>(closure);
+    mux->m_subCompleted.release();
+}
+
+// expires requests that ran out of time or have been cancelled
+// QFuture::cancel() has no synchronous callback: on Qt6 even the continuations of a QPromise-backed future run only when it is finished,
+// so the cancellation arrives through a QFutureWatcher in m_cancelThread
+void ResponseMux::expireLoop()
+{
+    QMutexLocker locker(&m_mutex);
+    while (!m_stopping) {
+        if (m_pending.isEmpty()) {
+            m_canceled.clear();
+            m_wakeUp.wait(&m_mutex);
+            continue;
+        }
+        qint64 now = m_clock.elapsed();
+        QList<std::shared_ptr<ResponseHandler>> expired;
+        while (!m_deadlines.isEmpty() && m_deadlines.firstKey() <= now) {
+            auto it = m_deadlines.begin();
+            expired += m_pending.take(it.value()).handler;
+            m_deadlines.erase(it);
+        }
+        for (const QByteArray& token : qAsConst(m_canceled)) {
+            // the request may have been completed meanwhile
+            auto it = m_pending.find(token);
+            if (it == m_pending.end()) {
+                continue;
+            }
+            if (it->deadline >= 0) {
+                m_deadlines.remove(it->deadline, token);
+            }
+            expired += it->handler;
+            m_pending.erase(it);
+        }
+        m_canceled.clear();
+
+        if (!expired.isEmpty()) {
+            locker.unlock();
+            for (const auto& handler : qAsConst(expired)) {
+                handler->expire(NATS_TIMEOUT);
+            }
+            expired.clear();
+            locker.relock();
+            continue;
+        }
+
+        if (m_deadlines.isEmpty()) {
+            m_wakeUp.wait(&m_mutex);
+        }
+        else {
+            m_wakeUp.wait(&m_mutex, static_cast<unsigned long>(qMax<qint64>(m_deadlines.firstKey() - now, 1)));
+        }
+    }
+}
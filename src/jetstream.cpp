@@ -7,6 +7,13 @@ Unless required by applicable law or agreed to in writing, software distributed
 #include "qtnats.h"
 #include "qtnats_p.h"
 
+#include <algorithm>
+
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+#include <QUuid>
+
 using namespace QtNats;
 
 static void checkJsError(natsStatus s, jsErrCode js)
@@ -15,21 +22,46 @@ static void checkJsError(natsStatus s, jsErrCode js)
     throw JetStreamException(s, js);
 }
 
+// need to pass it through QFuture
+static const int jsPublishAckTypeId = qRegisterMetaType<JsPublishAck>();
+
+// cnats destroys pae->Msg after the handler returns, so the signal gets a deep copy
+static Message copyMessage(natsMsg* cmsg)
+{
+    Message msg(QByteArray(natsMsg_GetSubject(cmsg)), QByteArray(natsMsg_GetData(cmsg), natsMsg_GetDataLength(cmsg)));
+    msg.reply = QByteArray(natsMsg_GetReply(cmsg));
+    decodeNatsHeaders(cmsg, msg.headers());
+    return msg;
+}
+
 static void jsPubErrHandler(jsCtx*, jsPubAckErr* pae, void* closure)
 {
     JetStream* js = reinterpret_cast<JetStream*>(closure);
-    Message msg (pae->Msg);
-    emit js->errorOccurred(pae->Err, pae->ErrCode, QString(pae->ErrText), msg);
+    emit js->errorOccurred(pae->Err, pae->ErrCode, QString(pae->ErrText), copyMessage(pae->Msg));
 }
 
 JetStream* Client::jetStream(const JsOptions& options)
 {
+    // an empty publish window would stall every asyncPublish until stallWait
+    if (options.maxPendingAsync <= 0) {
+        throw Exception(NATS_INVALID_ARG);
+    }
     JetStream* js = new JetStream(this);
+    js->m_guard = std::make_shared<JetStreamGuard>(js);
+    js->m_client = this;
+    js->m_timeout = options.timeout;
+    js->m_apiPrefix = options.domain.isEmpty() ? QByteArray("$JS.API") : "$JS." + options.domain + ".API";
+    js->m_retry = options.retry;
+    js->m_zeroCopy = m_zeroCopy;
+    js->m_publishWindow = std::make_shared<AsyncPublishWindow>(options.maxPendingAsync, options.stallWait);
     jsOptions jsOpts;
     jsOptions_Init(&jsOpts);
     jsOpts.Domain = options.domain.constData();
     jsOpts.Wait = options.timeout;
 
+    // asyncPublish doesn't use the cnats async publishing anymore, but js_PublishAsync may still be called on getJsContext()
+    jsOpts.PublishAsync.MaxPending = options.maxPendingAsync;
+    jsOpts.PublishAsync.StallWait = options.stallWait;
     jsOpts.PublishAsync.ErrHandler = &jsPubErrHandler;
     jsOpts.PublishAsync.ErrHandlerClosure = js;
 
@@ -39,35 +71,224 @@ JetStream* Client::jetStream(const JsOptions& options)
 
 void Message::ack()
 {
+    if (m_ackConnection) {
+        sendAck("+ACK", true);
+        return;
+    }
     jsErrCode jsErr;
-    natsStatus s = natsMsg_AckSync(m_natsMsg.get(), nullptr, &jsErr);
+    natsStatus s = natsMsg_AckSync(natsMessage(), nullptr, &jsErr);
     checkJsError(s, jsErr);
 }
 
+void Message::ackNoWait()
+{
+    if (m_ackConnection) {
+        sendAck("+ACK", false);
+        return;
+    }
+    checkError(natsMsg_Ack(natsMessage(), nullptr));
+}
+
+namespace {
+    // the server confirms an ack with an empty message
+    class AckRequest : public ResponseHandler
+    {
+    public:
+        bool deliver(natsMsg* msg) override
+        {
+            NatsMsgPtr msgPtr(msg, &natsMsg_Destroy);
+            if (!tryFinish()) {
+                return true;
+            }
+            if (natsMsg_IsNoResponders(msg)) {
+                // the consumer or the message is gone
+                promise.setException(Exception(NATS_NO_RESPONDERS));
+            }
+            promise.finish();
+            return true;
+        }
+
+        void expire(natsStatus status) override
+        {
+            if (!tryFinish()) {
+                return;
+            }
+            if (!promise.isCanceled()) {
+                promise.setException(Exception(status));
+            }
+            promise.finish();
+        }
+
+        QFutureWatcherBase* watchCancel() override { return promise.watch(); }
+
+        Promise<void> promise;
+    };
+}
+
+QFuture<void> Message::ackAsync(qint64 timeout)
+{
+    if (!m_ackConnection || reply.isEmpty()) {
+        // not received from a JetStream consumer by qtnats
+        throw Exception(NATS_ILLEGAL_STATE);
+    }
+    auto request = std::make_shared<AckRequest>();
+    QFuture<void> f = request->promise.future();
+    m_ackConnection->invoke([&](natsConnection* conn, ResponseMux* mux) {
+        QByteArray replySubject = mux->add(request, timeout);
+        try {
+            publishMessage(conn, Message(reply, "+ACK"), replySubject.constData());
+        }
+        catch (...) {
+            mux->remove(replySubject);
+            throw;
+        }
+    });
+    return f;
+}
+
 void Message::nack(qint64 delay)
 {
+    if (m_ackConnection) {
+        QByteArray nak = "-NAK";
+        if (delay != -1) {
+            nak += " {\"delay\":" + QByteArray::number(delay * 1000000) + "}";
+        }
+        sendAck(nak.constData(), false);
+        return;
+    }
     natsStatus s;
     if (delay == -1) {
-        s = natsMsg_Nak(m_natsMsg.get(), nullptr);
+        s = natsMsg_Nak(natsMessage(), nullptr);
     }
     else {
-        s = natsMsg_NakWithDelay(m_natsMsg.get(), delay, nullptr);
+        s = natsMsg_NakWithDelay(natsMessage(), delay, nullptr);
     }
     checkError(s);
 }
 
 void Message::inProgress()
 {
-    checkError(natsMsg_InProgress(m_natsMsg.get(), nullptr));
+    if (m_ackConnection) {
+        sendAck("+WPI", false);
+        return;
+    }
+    checkError(natsMsg_InProgress(natsMessage(), nullptr));
 }
 
 void Message::terminate()
 {
-    checkError(natsMsg_Term(m_natsMsg.get(), nullptr));
+    if (m_ackConnection) {
+        sendAck("+TERM", false);
+        return;
+    }
+    checkError(natsMsg_Term(natsMessage(), nullptr));
+}
+
+// the same protocol as cnats uses in natsMsg_Ack & co
+void Message::sendAck(const char* ackType, bool sync)
+{
+    if (reply.isEmpty()) {
+        throw Exception(NATS_ILLEGAL_STATE);
+    }
+    m_ackConnection->invoke([&](natsConnection* conn, ResponseMux*) {
+        if (!sync) {
+            checkError(natsConnection_PublishString(conn, reply.constData(), ackType));
+            return;
+        }
+        // Client::close() waits for it, but closing the connection would fail it anyway
+        natsMsg* response = nullptr;
+        checkError(natsConnection_RequestString(&response, conn, reply.constData(), ackType, m_ackTimeout));
+        natsMsg_Destroy(response);
+    });
+}
+
+// $JS.ACK.<stream>.<consumer>.<delivered>.<stream seq>.<consumer seq>.<timestamp>.<pending>
+// or $JS.ACK.<domain>.<account hash>.<stream>.<consumer>.<delivered>.<stream seq>.<consumer seq>.<timestamp>.<pending>.<token>
+static quint64 streamSequence(const QByteArray& ackSubject)
+{
+    QList<QByteArray> tokens = ackSubject.split('.');
+    if (tokens.size() == 9) {
+        return tokens[5].toULongLong();
+    }
+    if (tokens.size() >= 11) {
+        return tokens[7].toULongLong();
+    }
+    return 0;
+}
+
+AckBatcher* JetStream::ackBatcher(const AckBatchOptions& opts)
+{
+    if (opts.maxBatch <= 0) {
+        throw Exception(NATS_INVALID_ARG);
+    }
+    auto batcher = std::unique_ptr<AckBatcher>(new AckBatcher(nullptr));
+    batcher->m_opts = opts;
+    batcher->m_timer = new QTimer(batcher.get());
+    batcher->m_timer->setSingleShot(true);
+    batcher->m_timer->setInterval(int(opts.maxDelay));
+    connect(batcher->m_timer, &QTimer::timeout, batcher.get(), &AckBatcher::flush);
+    batcher->setParent(this);
+    return batcher.release();
+}
+
+AckBatcher::~AckBatcher() noexcept
+{
+    flush();
+}
+
+void AckBatcher::ack(const Message& msg)
+{
+    int size = 0;
+    {
+        QMutexLocker locker(&m_mutex);
+        m_pending.append(msg);
+        size = m_pending.size();
+    }
+    if (size >= m_opts.maxBatch || m_opts.maxDelay <= 0) {
+        flush();
+    }
+    else if (size == 1) {
+        // the timer must be started in its own thread
+        QMetaObject::invokeMethod(this, [this]() {
+            if (!m_timer->isActive()) {
+                m_timer->start();
+            }
+        }, Qt::QueuedConnection);
+    }
+}
+
+void AckBatcher::flush() noexcept
+{
+    QVector<Message> batch;
+    {
+        QMutexLocker locker(&m_mutex);
+        batch.swap(m_pending);
+    }
+    if (batch.isEmpty()) {
+        return;
+    }
+    if (m_opts.ackAll) {
+        // acknowledges all messages up to this one
+        Message last = *std::max_element(batch.begin(), batch.end(), [](const Message& a, const Message& b) {
+            return streamSequence(a.reply) < streamSequence(b.reply);
+        });
+        batch = { last };
+    }
+    // a failed ack doesn't stop the others
+    for (Message& msg : batch) {
+        try {
+            msg.ackNoWait();
+        }
+        catch (const Exception& e) {
+            emit errorOccurred(e.errorCode, QString::fromLatin1(e.what()));
+        }
+    }
 }
 
 PullSubscription::~PullSubscription() noexcept
 {
+    // waits for the callback to return
+    stopConsuming();
     natsSubscription_Destroy(m_sub);
 }
 
@@ -80,7 +301,7 @@ QList<Message> PullSubscription::fetch(int batch, qint64 timeout)
     checkJsError(s, jsErr);
     QList<Message> result;
     for (int i = 0; i < list.Count; i++) {
-        result += Message(list.Msgs[i]);
+        result += Message(list.Msgs[i], m_zeroCopy);
         list.Msgs[i] = nullptr; //natsMsgList_Destroy should destroy only the list, and keep the messages
     }
     natsMsgList_Destroy(&list);
@@ -89,10 +310,12 @@ QList<Message> PullSubscription::fetch(int batch, qint64 timeout)
 
 JetStream::~JetStream() noexcept
 {
+	// doesn't wait for pending acks: they still finish their futures, but don't emit signals or record latencies anymore
+	m_guard->reset();
 	jsCtx_Destroy(m_jsCtx);
 }
 
-static JsPublishAck fromJsPubAck(jsPubAck* ack)
+JsPublishAck QtNats::fromJsPubAck(jsPubAck* ack)
 {
     JsPublishAck result;
 
@@ -149,44 +372,47 @@ JsPublishAck JetStream::publish(const Message& msg, qint64 timeout)
 
 void JetStream::asyncPublish(const Message& msg, const JsPublishOptions& opts)
 {
-    jsPubOptions jsOpts;
-    jsPublishOptionsToC(opts, &jsOpts);
-    doAsyncPublish(msg, &jsOpts);
+    doAsyncPublish(msg, opts, true);
 }
 
 void JetStream::asyncPublish(const Message& msg, qint64 timeout)
 {
-    jsPubOptions jsOpts;
-    jsPubOptions_Init(&jsOpts);
-    if (timeout != -1) {
-        jsOpts.MaxWait = timeout;
-    }
-    doAsyncPublish(msg, &jsOpts);
+    JsPublishOptions opts;
+    opts.timeout = timeout;
+    doAsyncPublish(msg, opts, true);
+}
+
+QFuture<JsPublishAck> JetStream::asyncPublishWithAck(const Message& msg, const JsPublishOptions& opts)
+{
+    return doAsyncPublish(msg, opts, false);
+}
+
+QFuture<JsPublishAck> JetStream::asyncPublishWithAck(const Message& msg, qint64 timeout)
+{
+    JsPublishOptions opts;
+    opts.timeout = timeout;
+    return doAsyncPublish(msg, opts, false);
 }
 
 void JetStream::waitForPublishCompleted(qint64 timeout)
 {
-    // TODO use QtConcurrent::run and return QFuture?
-    natsStatus s = NATS_OK;
-    if (timeout != -1) {
-        jsPubOptions jsOpts;
-        jsPubOptions_Init(&jsOpts);
-        jsOpts.MaxWait = timeout;
-        s = js_PublishAsyncComplete(m_jsCtx, &jsOpts);
+    if (!m_publishWindow->waitForEmpty(timeout)) {
+        // the messages might still be acknowledged later
+        throw Exception(NATS_TIMEOUT);
     }
-    else {
-        s = js_PublishAsyncComplete(m_jsCtx, nullptr);
-    }
-    if (s == NATS_TIMEOUT) {
-        // optionally we can delete the messages, but they might be ACK'ed later
-        //natsMsgList list;
-        //js_PublishAsyncGetPendingList(&list, m_jsCtx);
-        //natsMsgList_Destroy(&list);
-    }
-    checkError(s);
+}
+
+QFuture<void> JetStream::publishCompleted()
+{
+    return m_publishWindow->completed();
 }
 
 Subscription* JetStream::subscribe(const QByteArray& subject, const QByteArray& stream, const QByteArray& consumer)
+{
+    return subscribe(subject, stream, consumer, MessageCallback());
+}
+
+Subscription* JetStream::subscribe(const QByteArray& subject, const QByteArray& stream, const QByteArray& consumer, MessageCallback callback)
 {
     jsSubOptions subOpts;
     jsSubOptions_Init(&subOpts);
@@ -194,9 +420,69 @@ Subscription* JetStream::subscribe(const QByteArray& subject, const QByteArray&
     subOpts.Consumer = consumer.constData();
     subOpts.ManualAck = true; // avoid _autoAckCB in cnats internals, because it takes over ownership of delivered messages
     auto sub = std::unique_ptr<Subscription>(new Subscription(nullptr));
+    sub->m_subject = subject;
+    sub->m_zeroCopy = m_zeroCopy;
+    sub->m_callback = std::move(callback);
+    // its messages are acknowledged by qtnats like the pulled ones, so that ackAsync works
+    sub->m_ackConnection = m_client->m_ackConnection;
+    if (m_timeout > 0) {
+        sub->m_ackTimeout = m_timeout;
+    }
     jsErrCode jsErr;
     natsStatus s = js_Subscribe(&sub->m_sub, m_jsCtx, subject.constData(), &subscriptionCallback, sub.get(), nullptr, &subOpts, &jsErr);
     checkJsError(s, jsErr);
+    registerSubscription(sub->m_sub, sub.get());
+    sub->setParent(this);
+    return sub.release();
+}
+
+Subscription* JetStream::orderedReader(const QByteArray& stream, quint64 startSequence, const QByteArray& filterSubject, MessageCallback callback)
+{
+    jsSubOptions subOpts;
+    jsSubOptions_Init(&subOpts);
+    if (startSequence > 1) {
+        subOpts.Config.DeliverPolicy = js_DeliverByStartSequence;
+        subOpts.Config.OptStartSeq = startSequence;
+    }
+    return doOrderedReader(stream, subOpts, filterSubject, std::move(callback));
+}
+
+Subscription* JetStream::orderedReader(const QByteArray& stream, const QDateTime& startTime, const QByteArray& filterSubject, MessageCallback callback)
+{
+    jsSubOptions subOpts;
+    jsSubOptions_Init(&subOpts);
+    subOpts.Config.DeliverPolicy = js_DeliverByStartTime;
+    subOpts.Config.OptStartTime = startTime.toMSecsSinceEpoch() * 1000000; // ns
+    return doOrderedReader(stream, subOpts, filterSubject, std::move(callback));
+}
+
+Subscription* JetStream::doOrderedReader(const QByteArray& stream, jsSubOptions& subOpts, QByteArray filterSubject, MessageCallback callback)
+{
+    jsErrCode jsErr = jsErrCode(0);
+    if (filterSubject.isEmpty()) {
+        // js_Subscribe needs a subject
+        jsStreamInfo* info = nullptr;
+        natsStatus s = js_GetStreamInfo(&info, m_jsCtx, stream.constData(), nullptr, &jsErr);
+        checkJsError(s, jsErr);
+        if (info->Config->SubjectsLen == 1) {
+            filterSubject = info->Config->Subjects[0];
+        }
+        jsStreamInfo_Destroy(info);
+        if (filterSubject.isEmpty()) {
+            throw Exception(NATS_INVALID_ARG);
+        }
+    }
+
+    // flow control, idle heartbeats and AckNone are set by cnats
+    subOpts.Stream = stream.constData();
+    subOpts.Ordered = true;
+    auto sub = std::unique_ptr<Subscription>(new Subscription(nullptr));
+    sub->m_subject = filterSubject;
+    sub->m_zeroCopy = m_zeroCopy;
+    sub->m_callback = std::move(callback);
+    natsStatus s = js_Subscribe(&sub->m_sub, m_jsCtx, filterSubject.constData(), &subscriptionCallback, sub.get(), nullptr, &subOpts, &jsErr);
+    checkJsError(s, jsErr);
+    registerSubscription(sub->m_sub, sub.get());
     sub->setParent(this);
     return sub.release();
 }
@@ -204,6 +490,7 @@ Subscription* JetStream::subscribe(const QByteArray& subject, const QByteArray&
 PullSubscription* JetStream::pullSubscribe(const QByteArray& subject, const QByteArray& stream, const QByteArray& consumer)
 {
     auto sub = std::unique_ptr<PullSubscription>(new PullSubscription(nullptr));
+    sub->m_zeroCopy = m_zeroCopy;
     jsErrCode jsErr;
  
     jsSubOptions subOpts;
@@ -213,6 +500,15 @@ PullSubscription* JetStream::pullSubscribe(const QByteArray& subject, const QByt
 
     natsStatus s = js_PullSubscribe(&sub->m_sub, m_jsCtx, subject.constData(), consumer.constData(), nullptr, &subOpts, &jsErr);
     checkJsError(s, jsErr);
+    sub->m_ackConnection = m_client->m_ackConnection;
+    sub->m_apiPrefix = m_apiPrefix;
+    if (m_timeout > 0) {
+        sub->m_ackTimeout = m_timeout;
+    }
+    // otherwise cnats has looked up the stream or created an ephemeral consumer, and nextSubject() asks it for the names
+    if (!stream.isEmpty() && !consumer.isEmpty()) {
+        sub->m_nextSubject = m_apiPrefix + ".CONSUMER.MSG.NEXT." + stream + '.' + consumer;
+    }
     sub->setParent(this);
     return sub.release();
 }
@@ -223,15 +519,351 @@ JsPublishAck JetStream::doPublish(const Message& msg, jsPubOptions* opts)
     jsPubAck* ack = nullptr;
     NatsMsgPtr cnatsMsg = toNatsMsg(msg);
 
+    QElapsedTimer timer;
+    timer.start();
     natsStatus s = js_PublishMsg(&ack, m_jsCtx, cnatsMsg.get(), opts, &jsErr);
     checkJsError(s, jsErr);
+    m_publishLatency.record(timer.nsecsElapsed());
 
     return fromJsPubAck(ack);
 }
 
-void JetStream::doAsyncPublish(const Message& msg, jsPubOptions* opts)
+bool AsyncPublishWindow::acquire(bool& becameFull)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_pending >= m_maxPending) {
+        QElapsedTimer timer;
+        timer.start();
+        qint64 left = m_stallWait;
+        while (m_pending >= m_maxPending && left > 0) {
+            m_changed.wait(&m_mutex, static_cast<unsigned long>(left));
+            left = m_stallWait - timer.elapsed();
+        }
+        if (m_pending >= m_maxPending) {
+            return false;
+        }
+    }
+    m_pending++;
+    if (m_pending >= m_maxPending && !m_full) {
+        m_full = true;
+        becameFull = true;
+    }
+    return true;
+}
+
+void AsyncPublishWindow::release(bool& drained)
 {
-    //js_PublishMsgAsync is tricky to manage lifetime of natsMsg, so let's go the safe way
-    //TODO headers will require js_PublishMsgAsync
-    checkError(js_PublishAsync(m_jsCtx, msg.subject.constData(), msg.data.constData(), msg.data.size(), opts));
+    QList<std::shared_ptr<Promise<void>>> waiters;
+    {
+        QMutexLocker locker(&m_mutex);
+        m_pending--;
+        if (m_full && m_pending <= m_maxPending / 2) {
+            m_full = false;
+            drained = true;
+        }
+        if (m_pending == 0) {
+            waiters.swap(m_completionWaiters);
+        }
+        m_changed.wakeAll();
+    }
+    for (const auto& promise : qAsConst(waiters)) {
+        promise->finish();
+    }
+}
+
+bool AsyncPublishWindow::waitForEmpty(qint64 timeout)
+{
+    QMutexLocker locker(&m_mutex);
+    QElapsedTimer timer;
+    timer.start();
+    while (m_pending > 0) {
+        if (timeout < 0) {
+            m_changed.wait(&m_mutex);
+            continue;
+        }
+        qint64 left = timeout - timer.elapsed();
+        if (left <= 0) {
+            return false;
+        }
+        m_changed.wait(&m_mutex, static_cast<unsigned long>(left));
+    }
+    return true;
+}
+
+QFuture<void> AsyncPublishWindow::completed()
+{
+    auto promise = std::make_shared<Promise<void>>();
+    QFuture<void> f = promise->future();
+    QMutexLocker locker(&m_mutex);
+    if (m_pending == 0) {
+        promise->finish();
+    }
+    else {
+        m_completionWaiters += promise;
+    }
+    return f;
+}
+
+namespace {
+    class JsPublishRequest;
+
+    // one attempt to publish the message of a JsPublishRequest, or the backoff before the next attempt
+    // every attempt is a separate entry in ResponseMux with its own finished flag, so that the late deadline of an attempt
+    // can't finish or resend the next one
+    class JsPublishAttempt : public ResponseHandler
+    {
+    public:
+        JsPublishAttempt(std::shared_ptr<JsPublishRequest> request, bool backoff) : m_request(std::move(request)), m_backoff(backoff) {}
+
+        bool deliver(natsMsg* msg) override;
+        void expire(natsStatus status) override;
+        QFutureWatcherBase* watchCancel() override;
+
+        // returns false if the attempt has been finished by deliver() or expire() meanwhile
+        bool abandon() { return tryFinish(); }
+
+    private:
+        const std::shared_ptr<JsPublishRequest> m_request;
+        const bool m_backoff;
+    };
+
+    // the ack of a JetStream message published asynchronously, arriving on the Client's shared inbox
+    // a failed message may be published again according to JsRetryPolicy; the backoff is just another deadline in ResponseMux
+    class JsPublishRequest : public std::enable_shared_from_this<JsPublishRequest>
+    {
+    public:
+        struct Context
+        {
+            std::shared_ptr<JetStreamGuard> js;
+            ResponseMux* mux;
+            natsConnection* conn;
+            LatencyHistogram* latency; // of the JetStream, so used only through js
+            std::shared_ptr<AsyncPublishWindow> window;
+            JsRetryPolicy retry;
+            qint64 timeout;
+            bool emitErrors;
+        };
+
+        JsPublishRequest(const Context& context, const Message& msg, const Message& jsMsg) :
+            m_context(context),
+            m_msg(msg),
+            m_jsMsg(jsMsg)
+        {}
+
+        // the first attempt throws if the message can't be published at all
+        void start()
+        {
+            m_timer.start();
+            auto attempt = std::make_shared<JsPublishAttempt>(shared_from_this(), false);
+            QByteArray reply = m_context.mux->add(attempt, m_context.timeout);
+            try {
+                publishMessage(m_context.conn, m_jsMsg, reply.constData());
+            }
+            catch (...) {
+                m_context.mux->remove(reply);
+                if (attempt->abandon()) {
+                    throw;
+                }
+                // the attempt has expired already, and the future reports it
+            }
+        }
+
+        // the ack or a status message of the current attempt
+        void replied(natsMsg* msg)
+        {
+            NatsMsgPtr msgPtr(msg, &natsMsg_Destroy);
+            if (natsMsg_IsNoResponders(msg)) {
+                // no stream is listening on this subject, e.g. during a leader election
+                retryOrFail(NATS_NO_RESPONDERS, jsErrCode(0), QString::fromLatin1(natsStatus_GetText(NATS_NO_RESPONDERS)), true);
+            }
+            else {
+                reportAck(QByteArray::fromRawData(natsMsg_GetData(msg), natsMsg_GetDataLength(msg)));
+            }
+        }
+
+        // the current attempt or backoff has run out of time, or the request was cancelled
+        void expired(natsStatus status, bool backoff)
+        {
+            if (promise.isCanceled()) {
+                done();
+                return;
+            }
+            if (backoff && status == NATS_TIMEOUT) {
+                resend();
+                return;
+            }
+            retryOrFail(status, jsErrCode(0), QString::fromLatin1(natsStatus_GetText(status)), !backoff && status == NATS_TIMEOUT);
+        }
+
+        Promise<JsPublishAck> promise;
+
+    private:
+        // e.g. {"stream":"MY_STREAM","seq":5,"duplicate":true} or {"error":{"code":400,"err_code":10071,"description":"..."}}
+        void reportAck(const QByteArray& json)
+        {
+            QJsonObject o = QJsonDocument::fromJson(json).object();
+            QJsonObject error = o.value("error").toObject();
+            if (!error.isEmpty()) {
+                // 503 means that JetStream is temporarily unavailable; other errors are rejections
+                retryOrFail(NATS_ERR, jsErrCode(error.value("err_code").toInt()), error.value("description").toString(),
+                    error.value("code").toInt() == 503);
+                return;
+            }
+            if (!o.contains("stream")) {
+                retryOrFail(NATS_ERR, jsErrCode(0), QStringLiteral("invalid JetStream ack"), false);
+                return;
+            }
+            qint64 latency = m_timer.nsecsElapsed();
+            m_context.js->invoke([this, latency](JetStream*) { m_context.latency->record(latency); });
+            JsPublishAck ack;
+            ack.stream = o.value("stream").toString().toUtf8();
+            ack.sequence = quint64(o.value("seq").toDouble());
+            ack.domain = o.value("domain").toString().toUtf8();
+            ack.duplicate = o.value("duplicate").toBool();
+            promise.addResult(ack);
+            done();
+        }
+
+        void retryOrFail(natsStatus status, jsErrCode jsErr, const QString& text, bool retryable)
+        {
+            const JsRetryPolicy& retry = m_context.retry;
+            if (retryable && m_attempt < retry.maxAttempts && !promise.isCanceled()) {
+                double backoff = retry.initialBackoff;
+                for (int i = 1; i < m_attempt && backoff < retry.maxBackoff; i++) {
+                    backoff *= retry.backoffMultiplier;
+                }
+                m_attempt++;
+                m_context.mux->add(std::make_shared<JsPublishAttempt>(shared_from_this(), true),
+                    qBound<qint64>(1, qint64(backoff), qMax<qint64>(1, retry.maxBackoff)));
+                return;
+            }
+            if (jsErr) {
+                promise.setException(JetStreamException(status, jsErr));
+            }
+            else {
+                promise.setException(Exception(status));
+            }
+            if (m_context.emitErrors) {
+                m_context.js->invoke([&](JetStream* js) { emit js->errorOccurred(status, jsErr, text, m_msg); });
+            }
+            done();
+        }
+
+        void resend()
+        {
+            auto attempt = std::make_shared<JsPublishAttempt>(shared_from_this(), false);
+            QByteArray reply = m_context.mux->add(attempt, m_context.timeout);
+            try {
+                publishMessage(m_context.conn, m_jsMsg, reply.constData());
+            }
+            catch (const Exception& e) {
+                // e.g. the connection is closed
+                m_context.mux->remove(reply);
+                if (attempt->abandon()) {
+                    retryOrFail(e.errorCode, jsErrCode(0), QString::fromLatin1(e.what()), false);
+                }
+            }
+        }
+
+        void done()
+        {
+            promise.finish();
+            bool drained = false;
+            m_context.window->release(drained);
+            if (drained) {
+                m_context.js->invoke([](JetStream* js) { emit js->publishWindowDrained(); });
+            }
+        }
+
+        const Context m_context;
+        const Message m_msg;
+        const Message m_jsMsg; // with the JetStream headers
+        int m_attempt = 1; // only one attempt is active at a time, so it isn't accessed concurrently
+        QElapsedTimer m_timer;
+    };
+
+    bool JsPublishAttempt::deliver(natsMsg* msg)
+    {
+        if (!tryFinish()) {
+            natsMsg_Destroy(msg);
+            return true;
+        }
+        m_request->replied(msg);
+        return true;
+    }
+
+    void JsPublishAttempt::expire(natsStatus status)
+    {
+        if (tryFinish()) {
+            m_request->expired(status, m_backoff);
+        }
+    }
+
+    QFutureWatcherBase* JsPublishAttempt::watchCancel()
+    {
+        return m_request->promise.watch();
+    }
+}
+
+// same headers as set by cnats for jsPubOptions
+static void addJsHeaders(Message& msg, const JsPublishOptions& opts)
+{
+    MessageHeaders& headers = msg.headers();
+    if (opts.msgID.size()) {
+        headers.replace("Nats-Msg-Id", opts.msgID);
+    }
+    if (opts.expectStream.size()) {
+        headers.replace("Nats-Expected-Stream", opts.expectStream);
+    }
+    if (opts.expectLastMessageID.size()) {
+        headers.replace("Nats-Expected-Last-Msg-Id", opts.expectLastMessageID);
+    }
+    if (opts.expectLastSequence) {
+        headers.replace("Nats-Expected-Last-Sequence", QByteArray::number(opts.expectLastSequence));
+    }
+    if (opts.expectLastSubjectSequence) {
+        headers.replace("Nats-Expected-Last-Subject-Sequence", QByteArray::number(opts.expectLastSubjectSequence));
+    }
+    else if (opts.expectNoMessage) {
+        headers.replace("Nats-Expected-Last-Subject-Sequence", "0");
+    }
+}
+
+// cnats has no hook for individual async acks, so the message is published with a reply subject on the Client's shared inbox
+// and JsPublishRequest tracks the ack
+QFuture<JsPublishAck> JetStream::doAsyncPublish(const Message& msg, const JsPublishOptions& opts, bool emitErrors)
+{
+    ResponseMux* mux = m_client->m_responseMux;
+    if (!mux) {
+        throw Exception(NATS_CONNECTION_CLOSED);
+    }
+    bool full = false;
+    bool acquired = m_publishWindow->acquire(full);
+    if (full) {
+        emit publishWindowFull();
+    }
+    if (!acquired) {
+        throw Exception(NATS_TIMEOUT); // stalled for longer than JsOptions::stallWait
+    }
+
+    Message jsMsg = msg;
+    addJsHeaders(jsMsg, opts);
+    // let the server drop duplicates if an ack was lost, and the message is published again
+    if (m_retry.maxAttempts > 1 && m_retry.autoMsgId && !jsMsg.headers().contains("Nats-Msg-Id")) {
+        jsMsg.headers().insert("Nats-Msg-Id", QUuid::createUuid().toByteArray(QUuid::WithoutBraces));
+    }
+
+    JsPublishRequest::Context context { m_guard, mux, m_client->m_conn, &m_publishLatency, m_publishWindow, m_retry,
+        opts.timeout > 0 ? opts.timeout : m_timeout, emitErrors };
+    auto request = std::make_shared<JsPublishRequest>(context, msg, jsMsg);
+    QFuture<JsPublishAck> f = request->promise.future();
+    try {
+        request->start();
+    }
+    catch (...) {
+        bool drained = false;
+        m_publishWindow->release(drained);
+        throw;
+    }
+    return f;
 }
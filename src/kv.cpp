@@ -0,0 +1,345 @@
+/* Copyright(c) 2022 Petro Kazmirchuk https://github.com/Kazmirchuk
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with the License.You may obtain a copy of the License at http ://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.See the License for the specific language governing permissions and  limitations under the License.
+*/
+
+#include "qtnats.h"
+#include "qtnats_p.h"
+
+#include <QHash>
+#include <QReadWriteLock>
+#include <QRegularExpression>
+
+using namespace QtNats;
+
+static const int keyValueEntryTypeId = qRegisterMetaType<KeyValueEntry>();
+
+namespace QtNats {
+    // the latest revision of every key of a bucket; deleted keys are kept as tombstones,
+    // so that an older revision arriving late from the watcher can't resurrect them
+    class KeyValueCache
+    {
+    public:
+        // returns false if the cache has a newer revision already
+        bool update(const KeyValueEntry& entry)
+        {
+            QWriteLocker locker(&lock);
+            auto it = entries.find(entry.key);
+            if (it != entries.end() && it->revision >= entry.revision) {
+                return false;
+            }
+            entries.insert(entry.key, entry);
+            return true;
+        }
+
+        mutable QReadWriteLock lock;
+        QHash<QByteArray, KeyValueEntry> entries;
+        QSemaphore loaded;
+    };
+}
+
+// takes ownership of e
+static KeyValueEntry fromKvEntry(kvEntry* e)
+{
+    KeyValueEntry entry;
+    entry.key = kvEntry_Key(e);
+    entry.value = QByteArray(static_cast<const char*>(kvEntry_Value(e)), kvEntry_ValueLen(e));
+    entry.revision = kvEntry_Revision(e);
+    entry.created = QDateTime::fromMSecsSinceEpoch(kvEntry_Created(e) / 1000000, Qt::UTC);
+    entry.delta = kvEntry_Delta(e);
+    switch (kvEntry_Operation(e)) {
+    case kvOp_Delete:
+        entry.operation = KeyValueOperation::Delete;
+        break;
+    case kvOp_Purge:
+        entry.operation = KeyValueOperation::Purge;
+        break;
+    default:
+        entry.operation = KeyValueOperation::Put;
+    }
+    kvEntry_Destroy(e);
+    return entry;
+}
+
+// a bucket in another JetStream domain is written through its API prefix
+static QByteArray putPrefix(const QByteArray& apiPrefix, const QByteArray& bucket)
+{
+    QByteArray prefix = "$KV." + bucket + '.';
+    return apiPrefix == "$JS.API" ? prefix : apiPrefix + '.' + prefix;
+}
+
+KeyValue* JetStream::createKeyValue(const KeyValueConfig& config)
+{
+    kvConfig cfg;
+    kvConfig_Init(&cfg);
+    cfg.Bucket = config.bucket.constData();
+    cfg.Description = config.description.constData();
+    cfg.History = uint8_t(config.history);
+    cfg.TTL = config.ttl * 1000000; // ns
+    cfg.MaxBytes = config.maxBytes;
+    cfg.MaxValueSize = config.maxValueSize;
+    cfg.StorageType = config.memoryStorage ? js_MemoryStorage : js_FileStorage;
+    cfg.Replicas = config.replicas;
+
+    auto kv = std::unique_ptr<KeyValue>(new KeyValue(nullptr));
+    kv->m_js = this;
+    kv->m_bucket = config.bucket;
+    kv->m_putPrefix = putPrefix(m_apiPrefix, config.bucket);
+    checkError(js_CreateKeyValue(&kv->m_kv, m_jsCtx, &cfg));
+    kv->setParent(this);
+    return kv.release();
+}
+
+KeyValue* JetStream::keyValue(const QByteArray& bucket)
+{
+    auto kv = std::unique_ptr<KeyValue>(new KeyValue(nullptr));
+    kv->m_js = this;
+    kv->m_bucket = bucket;
+    kv->m_putPrefix = putPrefix(m_apiPrefix, bucket);
+    checkError(js_KeyValue(&kv->m_kv, m_jsCtx, bucket.constData()));
+    kv->setParent(this);
+    return kv.release();
+}
+
+void JetStream::deleteKeyValue(const QByteArray& bucket)
+{
+    checkError(js_DeleteKeyValue(m_jsCtx, bucket.constData()));
+}
+
+KeyValue::~KeyValue() noexcept
+{
+    // the watcher thread must not touch m_cache anymore
+    delete m_cacheWatcher;
+    qDeleteAll(findChildren<KeyValueWatcher*>(QString(), Qt::FindDirectChildrenOnly));
+    kvStore_Destroy(m_kv);
+}
+
+KeyValueEntry KeyValue::get(const QByteArray& key) const
+{
+    if (m_cache) {
+        QReadLocker locker(&m_cache->lock);
+        auto it = m_cache->entries.constFind(key);
+        if (it == m_cache->entries.constEnd() || it->operation != KeyValueOperation::Put) {
+            throw Exception(NATS_NOT_FOUND);
+        }
+        return *it;
+    }
+    kvEntry* e = nullptr;
+    checkError(kvStore_Get(&e, m_kv, key.constData()));
+    return fromKvEntry(e);
+}
+
+KeyValueEntry KeyValue::get(const QByteArray& key, quint64 revision) const
+{
+    kvEntry* e = nullptr;
+    checkError(kvStore_GetRevision(&e, m_kv, key.constData(), revision));
+    return fromKvEntry(e);
+}
+
+quint64 KeyValue::put(const QByteArray& key, const QByteArray& value)
+{
+    uint64_t revision = 0;
+    checkError(kvStore_Put(&revision, m_kv, key.constData(), value.constData(), value.size()));
+    updateCache(key, value, revision);
+    return revision;
+}
+
+quint64 KeyValue::create(const QByteArray& key, const QByteArray& value)
+{
+    uint64_t revision = 0;
+    checkError(kvStore_Create(&revision, m_kv, key.constData(), value.constData(), value.size()));
+    updateCache(key, value, revision);
+    return revision;
+}
+
+quint64 KeyValue::update(const QByteArray& key, const QByteArray& value, quint64 lastRevision)
+{
+    uint64_t revision = 0;
+    checkError(kvStore_Update(&revision, m_kv, key.constData(), value.constData(), value.size(), lastRevision));
+    updateCache(key, value, revision);
+    return revision;
+}
+
+// read-your-writes: the watcher will deliver the same revision later, and it will be ignored
+void KeyValue::updateCache(const QByteArray& key, const QByteArray& value, quint64 revision)
+{
+    if (!m_cache) {
+        return;
+    }
+    KeyValueEntry entry;
+    entry.key = key;
+    entry.value = value;
+    entry.revision = revision;
+    entry.created = QDateTime::currentDateTimeUtc();
+    m_cache->update(entry);
+}
+
+void KeyValue::remove(const QByteArray& key)
+{
+    if (m_cache) {
+        publishMarker(key, KeyValueOperation::Delete);
+        return;
+    }
+    checkError(kvStore_Delete(m_kv, key.constData()));
+}
+
+void KeyValue::purge(const QByteArray& key)
+{
+    if (m_cache) {
+        publishMarker(key, KeyValueOperation::Purge);
+        return;
+    }
+    checkError(kvStore_Purge(m_kv, key.constData(), nullptr));
+}
+
+// the same delete marker as published by kvStore_Delete and kvStore_Purge, which don't return its revision
+// the cache needs it for a tombstone that a Put arriving late from the watcher can't overwrite
+void KeyValue::publishMarker(const QByteArray& key, KeyValueOperation operation)
+{
+    // validated like in cnats
+    static const QRegularExpression validKey(QStringLiteral("^[-/_=\\.a-zA-Z0-9]+$"));
+    if (!validKey.match(QString::fromLatin1(key)).hasMatch() || key.startsWith('.') || key.endsWith('.')) {
+        throw Exception(NATS_INVALID_ARG);
+    }
+    Message marker(m_putPrefix + key, QByteArray());
+    if (operation == KeyValueOperation::Purge) {
+        marker.headers().insert("KV-Operation", "PURGE");
+        marker.headers().insert("Nats-Rollup", "sub"); // the server removes the previous revisions of the key
+    }
+    else {
+        marker.headers().insert("KV-Operation", "DEL");
+    }
+    KeyValueEntry entry;
+    entry.key = key;
+    entry.revision = m_js->publish(marker).sequence;
+    entry.created = QDateTime::currentDateTimeUtc();
+    entry.operation = operation;
+    m_cache->update(entry);
+}
+
+QList<QByteArray> KeyValue::keys() const
+{
+    kvKeysList list { nullptr, 0 };
+    natsStatus s = kvStore_Keys(&list, m_kv, nullptr);
+    QList<QByteArray> result;
+    if (s == NATS_NOT_FOUND) {
+        return result; // the bucket is empty
+    }
+    checkError(s);
+    for (int i = 0; i < list.Count; i++) {
+        result += QByteArray(list.Keys[i]);
+    }
+    kvKeysList_Destroy(&list);
+    return result;
+}
+
+QList<KeyValueEntry> KeyValue::history(const QByteArray& key) const
+{
+    kvEntryList list { nullptr, 0 };
+    natsStatus s = kvStore_History(&list, m_kv, key.constData(), nullptr);
+    QList<KeyValueEntry> result;
+    if (s == NATS_NOT_FOUND) {
+        return result;
+    }
+    checkError(s);
+    for (int i = 0; i < list.Count; i++) {
+        result += fromKvEntry(list.Entries[i]);
+        list.Entries[i] = nullptr; // already destroyed
+    }
+    kvEntryList_Destroy(&list);
+    return result;
+}
+
+KeyValueWatcher* KeyValue::watch(const QByteArray& keys, bool includeHistory)
+{
+    kvWatchOptions opts;
+    kvWatchOptions_Init(&opts);
+    opts.IncludeHistory = includeHistory;
+
+    auto watcher = std::unique_ptr<KeyValueWatcher>(new KeyValueWatcher(nullptr));
+    checkError(kvStore_Watch(&watcher->m_watcher, m_kv, keys.constData(), &opts));
+    watcher->m_thread = QThread::create([w = watcher.get()]() { w->run(); });
+    watcher->m_thread->start();
+    watcher->setParent(this);
+    return watcher.release();
+}
+
+void KeyValue::enableCache(qint64 timeout)
+{
+    if (m_cache) {
+        return;
+    }
+    auto cache = std::make_shared<KeyValueCache>();
+    kvWatchOptions opts;
+    kvWatchOptions_Init(&opts);
+
+    // not a child of this, so that it is stopped before m_cache is gone
+    auto watcher = std::unique_ptr<KeyValueWatcher>(new KeyValueWatcher(nullptr));
+    watcher->m_handler = [cache](const KeyValueEntry* entry) {
+        if (entry) {
+            cache->update(*entry);
+        }
+        else {
+            cache->loaded.release();
+        }
+    };
+    checkError(kvStore_WatchAll(&watcher->m_watcher, m_kv, &opts));
+    watcher->m_thread = QThread::create([w = watcher.get()]() { w->run(); });
+    watcher->m_thread->start();
+
+    if (!cache->loaded.tryAcquire(1, int(timeout))) {
+        throw Exception(NATS_TIMEOUT);
+    }
+    m_cacheWatcher = watcher.release();
+    m_cache = cache;
+}
+
+KeyValueWatcher::~KeyValueWatcher() noexcept
+{
+    stop();
+    kvWatcher_Destroy(m_watcher);
+}
+
+void KeyValueWatcher::stop() noexcept
+{
+    if (!m_thread) {
+        return;
+    }
+    // kvWatcher_Next returns with an error after kvWatcher_Stop
+    kvWatcher_Stop(m_watcher);
+    m_thread->wait();
+    delete m_thread;
+    m_thread = nullptr;
+}
+
+void KeyValueWatcher::run()
+{
+    while (true) {
+        kvEntry* e = nullptr;
+        natsStatus s = kvWatcher_Next(&e, m_watcher, 1000);
+        if (s == NATS_TIMEOUT) {
+            continue;
+        }
+        if (s != NATS_OK) {
+            return; // stopped
+        }
+        if (!e) {
+            // cnats marks the end of the initial values with a NULL entry
+            if (m_handler) {
+                m_handler(nullptr);
+            }
+            else {
+                emit initialValuesReceived();
+            }
+            continue;
+        }
+        KeyValueEntry entry = fromKvEntry(e);
+        if (m_handler) {
+            m_handler(&entry);
+        }
+        else {
+            emit updated(entry);
+        }
+    }
+}
@@ -0,0 +1,400 @@
+/* Copyright(c) 2022 Petro Kazmirchuk https://github.com/Kazmirchuk
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with the License.You may obtain a copy of the License at http ://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.See the License for the specific language governing permissions and  limitations under the License.
+*/
+
+#include "qtnats.h"
+#include "qtnats_p.h"
+
+#include <cstdlib>
+
+using namespace QtNats;
+
+bool PullRequest::deliver(natsMsg* msg)
+{
+    const char* status = nullptr;
+    if (natsMsgHeader_Get(msg, "Status", &status) != NATS_OK || !status) {
+        Message m(msg, m_zeroCopy);
+        m.m_ackConnection = m_ackConnection;
+        m.m_ackTimeout = m_ackTimeout;
+        return received(std::move(m));
+    }
+    NatsMsgPtr msgPtr(msg, &natsMsg_Destroy);
+    if (natsMsg_IsNoResponders(msg)) {
+        ended(NATS_NO_RESPONDERS, QString::fromLatin1(natsStatus_GetText(NATS_NO_RESPONDERS)));
+        return true;
+    }
+    const char* description = nullptr;
+    natsMsgHeader_Get(msg, "Description", &description);
+    QString text = QString::fromUtf8(description ? description : status);
+
+    switch (atoi(status)) {
+    case 100: // Idle Heartbeat
+        return false;
+    case 404: // No Messages
+    case 408: // Request Timeout
+        ended(NATS_OK, text);
+        break;
+    case 409:
+        // the request is over, but the consumer is fine
+        if (text.contains("MaxBytes") || text.contains("Batch Completed")) {
+            ended(NATS_OK, text);
+        }
+        else {
+            ended(NATS_ERR, text); // e.g. Consumer Deleted
+        }
+        break;
+    default:
+        ended(NATS_ERR, text);
+    }
+    return true;
+}
+
+QByteArray PullRequest::body(int batch, int maxBytes, qint64 expires, qint64 idleHeartbeat, bool noWait)
+{
+    // durations are in ns
+    QByteArray json = "{\"batch\":" + QByteArray::number(batch);
+    if (maxBytes > 0) {
+        json += ",\"max_bytes\":" + QByteArray::number(maxBytes);
+    }
+    if (expires > 0) {
+        json += ",\"expires\":" + QByteArray::number(expires * 1000000);
+    }
+    if (idleHeartbeat > 0) {
+        json += ",\"idle_heartbeat\":" + QByteArray::number(idleHeartbeat * 1000000);
+    }
+    if (noWait) {
+        json += ",\"no_wait\":true";
+    }
+    return json + '}';
+}
+
+namespace {
+    // a single pull request of fetchAsync
+    class FetchRequest : public PullRequest
+    {
+    public:
+        FetchRequest(std::shared_ptr<AckConnection> ackConnection, bool zeroCopy, qint64 ackTimeout, int batch) :
+            PullRequest(std::move(ackConnection), zeroCopy, ackTimeout),
+            m_batch(batch)
+        {}
+
+        QFutureWatcherBase* watchCancel() override { return promise.watch(); }
+
+        Promise<QList<Message>> promise;
+
+    protected:
+        bool received(Message&& msg) override
+        {
+            // received() and ended() may race when the request expires
+            QMutexLocker locker(&m_mutex);
+            if (isFinished()) {
+                return true;
+            }
+            m_messages += std::move(msg);
+            if (m_messages.size() < m_batch || !tryFinish()) {
+                return isFinished();
+            }
+            promise.addResult(m_messages);
+            promise.finish();
+            return true;
+        }
+
+        void ended(natsStatus status, const QString& /*text*/) override
+        {
+            QMutexLocker locker(&m_mutex);
+            if (!tryFinish()) {
+                return;
+            }
+            if (promise.isCanceled()) {
+                // nothing to report
+            }
+            else if (!m_messages.isEmpty() && (status == NATS_OK || status == NATS_TIMEOUT)) {
+                promise.addResult(m_messages);
+            }
+            else {
+                // like natsSubscription_Fetch
+                promise.setException(Exception(status == NATS_OK ? NATS_TIMEOUT : status));
+            }
+            promise.finish();
+        }
+
+    private:
+        const int m_batch;
+        QMutex m_mutex;
+        QList<Message> m_messages;
+    };
+}
+
+namespace QtNats {
+    class ConsumeRequest;
+
+    // keeps PullConsumeOptions::prefetch pull requests outstanding and sends more of them at the low-water mark
+    class PullConsumer : public std::enable_shared_from_this<PullConsumer>
+    {
+    public:
+        PullConsumer(PullSubscription* sub, const PullConsumeOptions& opts, MessageCallback callback);
+
+        void refill();
+        // doesn't wait for the callback if called from it
+        void stop() noexcept;
+
+        // returns true if the request is complete
+        bool received(ConsumeRequest* request, Message&& msg);
+        void ended(ConsumeRequest* request, natsStatus status, const QString& text);
+
+    private:
+        bool enterCallback();
+        void leaveCallback();
+
+        PullSubscription* const m_sub;
+        const PullConsumeOptions m_opts;
+        const MessageCallback m_callback;
+        const QByteArray m_nextSubject;
+        const qint64 m_timeout; // of a single pull request in ResponseMux
+        int m_lowWaterMark = 0;
+
+        QMutex m_mutex;
+        QWaitCondition m_callbacksDone;
+        bool m_stopped = false;
+        int m_callbacks = 0; // threads inside received() or ended()
+        int m_requested = 0; // messages requested and not delivered yet
+        QHash<ConsumeRequest*, QByteArray> m_outstanding; // -> reply subject
+        static thread_local PullConsumer* t_callbackOwner;
+    };
+
+    class ConsumeRequest : public PullRequest
+    {
+    public:
+        ConsumeRequest(std::shared_ptr<AckConnection> ackConnection, bool zeroCopy, qint64 ackTimeout, std::shared_ptr<PullConsumer> consumer, int batch) :
+            PullRequest(std::move(ackConnection), zeroCopy, ackTimeout),
+            remaining(batch),
+            m_consumer(std::move(consumer))
+        {}
+
+        // guarded by PullConsumer::m_mutex
+        int remaining;
+        bool done = false;
+
+    protected:
+        bool received(Message&& msg) override
+        {
+            return m_consumer->received(this, std::move(msg));
+        }
+        void ended(natsStatus status, const QString& text) override
+        {
+            m_consumer->ended(this, status, text);
+        }
+
+    private:
+        const std::shared_ptr<PullConsumer> m_consumer;
+    };
+}
+
+thread_local PullConsumer* PullConsumer::t_callbackOwner = nullptr;
+
+PullConsumer::PullConsumer(PullSubscription* sub, const PullConsumeOptions& opts, MessageCallback callback) :
+    m_sub(sub),
+    m_opts(opts),
+    m_callback(std::move(callback)),
+    m_nextSubject(sub->nextSubject()),
+    // the server ends a request with 408 after expires; heartbeats move the deadline forward
+    m_timeout(opts.expires + qMax<qint64>(2 * opts.idleHeartbeat, 1000))
+{
+    m_lowWaterMark = opts.lowWaterMark >= 0 ? opts.lowWaterMark : opts.batch * (opts.prefetch - 1);
+}
+
+void PullConsumer::refill()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_stopped) {
+        return;
+    }
+    if (!m_outstanding.isEmpty() && m_requested > m_lowWaterMark) {
+        return;
+    }
+    const Message pull(m_nextSubject, PullRequest::body(m_opts.batch, m_opts.maxBytes, m_opts.expires, m_opts.idleHeartbeat));
+    const std::shared_ptr<AckConnection>& ackConnection = m_sub->m_ackConnection;
+    bool open = ackConnection->tryInvoke([&](natsConnection* conn, ResponseMux* mux) {
+        while (m_outstanding.size() < m_opts.prefetch) {
+            auto request = std::make_shared<ConsumeRequest>(ackConnection, m_sub->m_zeroCopy, m_sub->m_ackTimeout, shared_from_this(), m_opts.batch);
+            QByteArray reply = mux->add(request, m_timeout, m_opts.idleHeartbeat > 0 ? 2 * m_opts.idleHeartbeat : 0);
+            try {
+                publishMessage(conn, pull, reply.constData());
+            }
+            catch (const Exception&) {
+                // e.g. the connection is closed; the requests already sent keep going
+                mux->remove(reply);
+                return;
+            }
+            m_outstanding.insert(request.get(), reply);
+            m_requested += m_opts.batch;
+        }
+    });
+    if (!open) {
+        // the Client is closed
+        m_stopped = true;
+    }
+}
+
+void PullConsumer::stop() noexcept
+{
+    QMutexLocker locker(&m_mutex);
+    m_stopped = true;
+    // after Client::close(), its ResponseMux has failed the requests already
+    m_sub->m_ackConnection->tryInvoke([this](natsConnection*, ResponseMux* mux) {
+        for (const QByteArray& reply : qAsConst(m_outstanding)) {
+            mux->remove(reply);
+        }
+    });
+    m_outstanding.clear();
+    if (t_callbackOwner == this) {
+        return;
+    }
+    while (m_callbacks > 0) {
+        m_callbacksDone.wait(&m_mutex);
+    }
+}
+
+bool PullConsumer::enterCallback()
+{
+    if (m_stopped) {
+        return false;
+    }
+    m_callbacks++;
+    t_callbackOwner = this;
+    return true;
+}
+
+void PullConsumer::leaveCallback()
+{
+    QMutexLocker locker(&m_mutex);
+    t_callbackOwner = nullptr;
+    if (--m_callbacks == 0) {
+        m_callbacksDone.wakeAll();
+    }
+}
+
+bool PullConsumer::received(ConsumeRequest* request, Message&& msg)
+{
+    bool complete = false;
+    {
+        QMutexLocker locker(&m_mutex);
+        // a message may still arrive after the request has expired
+        if (!request->done) {
+            m_requested--;
+            if (--request->remaining == 0) {
+                request->done = true;
+                m_outstanding.remove(request);
+            }
+        }
+        complete = request->done;
+        if (!enterCallback()) {
+            return complete;
+        }
+    }
+    if (m_callback) {
+        m_callback(std::move(msg));
+    }
+    else {
+        emit m_sub->received(msg);
+    }
+    leaveCallback();
+    refill();
+    return complete;
+}
+
+void PullConsumer::ended(ConsumeRequest* request, natsStatus status, const QString& text)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (request->done) {
+            return;
+        }
+        request->done = true;
+        m_requested -= request->remaining;
+        m_outstanding.remove(request);
+        if (status == NATS_OK || (status == NATS_TIMEOUT && m_opts.idleHeartbeat <= 0)) {
+            locker.unlock();
+            refill();
+            return;
+        }
+        if (!enterCallback()) {
+            return;
+        }
+        if (status != NATS_TIMEOUT) {
+            // e.g. the consumer was deleted, or the Client is closed and its ResponseMux can't take new requests
+            // stopped right away, so that the other outstanding requests don't report the same error
+            m_stopped = true;
+        }
+    }
+    if (status == NATS_TIMEOUT) {
+        // the server may have lost the request, so it is replaced with a new one
+        emit m_sub->errorOccurred(NATS_MISSED_HEARTBEAT, QString::fromLatin1(natsStatus_GetText(NATS_MISSED_HEARTBEAT)));
+        leaveCallback();
+        refill();
+        return;
+    }
+    emit m_sub->errorOccurred(status, text);
+    leaveCallback();
+}
+
+// the server ends the pull request with 408 after timeout; the ResponseMux deadline covers a lost request
+QFuture<QList<Message>> PullSubscription::fetchAsync(int batch, int maxBytes, qint64 timeout)
+{
+    if (batch <= 0 || timeout <= 0) {
+        throw Exception(NATS_INVALID_ARG);
+    }
+    const Message pull(nextSubject(), PullRequest::body(batch, maxBytes, timeout, 0));
+    auto request = std::make_shared<FetchRequest>(m_ackConnection, m_zeroCopy, m_ackTimeout, batch);
+    QFuture<QList<Message>> f = request->promise.future();
+    m_ackConnection->invoke([&](natsConnection* conn, ResponseMux* mux) {
+        QByteArray reply = mux->add(request, timeout + 1000);
+        try {
+            publishMessage(conn, pull, reply.constData());
+        }
+        catch (...) {
+            mux->remove(reply);
+            throw;
+        }
+    });
+    return f;
+}
+
+void PullSubscription::consume(const PullConsumeOptions& opts)
+{
+    consume(MessageCallback(), opts);
+}
+
+void PullSubscription::consume(MessageCallback callback, const PullConsumeOptions& opts)
+{
+    if (opts.batch <= 0 || opts.prefetch <= 0 || (opts.idleHeartbeat > 0 && opts.idleHeartbeat >= opts.expires)) {
+        throw Exception(NATS_INVALID_ARG);
+    }
+    stopConsuming();
+    m_consumer = std::make_shared<PullConsumer>(this, opts, std::move(callback));
+    m_consumer->refill();
+}
+
+void PullSubscription::stopConsuming() noexcept
+{
+    if (m_consumer) {
+        m_consumer->stop();
+    }
+}
+
+QByteArray PullSubscription::nextSubject()
+{
+    if (m_nextSubject.isEmpty()) {
+        jsConsumerInfo* info = nullptr;
+        jsErrCode jsErr = jsErrCode(0);
+        natsStatus s = natsSubscription_GetConsumerInfo(&info, m_sub, nullptr, &jsErr);
+        if (s != NATS_OK) {
+            throw JetStreamException(s, jsErr);
+        }
+        m_nextSubject = m_apiPrefix + ".CONSUMER.MSG.NEXT." + info->Stream + '.' + info->Name;
+        jsConsumerInfo_Destroy(info);
+    }
+    return m_nextSubject;
+}
@@ -10,7 +10,14 @@ Unless required by applicable law or agreed to in writing, software distributed
 #include <opts.h>
 
 #include <QThread>
-#include <QFutureInterface>
+#include <QMutex>
+
+#if defined(Q_OS_LINUX)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(Q_OS_WIN)
+#include <windows.h>
+#endif
 
 using namespace QtNats;
 
@@ -72,20 +79,38 @@ static natsOptions* buildNatsOptions(const Options& opts)
     checkError(natsOptions_SetReconnectBufSize(o, opts.reconnectBufferSize));
     checkError(natsOptions_SetMaxPendingMsgs(o, opts.maxPendingMessages));
     checkError(natsOptions_SetNoEcho(o, !opts.echo));  //NB! reverted flag
+    checkError(natsOptions_SetSendAsap(o, opts.flushPolicy == FlushPolicy::SendAsap));
 
     return o;
 }
 
 // need to pass it through queued signal-slot connections
 static const int messageTypeId = qRegisterMetaType<Message>();
+static const int messageVectorTypeId = qRegisterMetaType<QVector<Message>>();
+
+// in zero-copy mode the QByteArray doesn't own the buffer - it is owned by natsMsg, which is kept alive by m_incoming
+static QByteArray fromMsgBuffer(const char* buffer, int size, bool zeroCopy)
+{
+    if (!buffer) {
+        return QByteArray();
+    }
+    return zeroCopy ? QByteArray::fromRawData(buffer, size) : QByteArray(buffer, size);
+}
 
-Message::Message(natsMsg* msg) noexcept:
-    m_natsMsg(msg, &natsMsg_Destroy)
+Message::Message(natsMsg* msg, bool zeroCopy) noexcept:
+    m_incoming(std::make_shared<IncomingMessage>(msg)),
+    m_ownHeaders(false)
 {
-    subject = QByteArray(natsMsg_GetSubject(msg));
-    data = QByteArray(natsMsg_GetData(msg), natsMsg_GetDataLength(msg));
-    reply = QByteArray(natsMsg_GetReply(msg));
+    const char* cnatsSubject = natsMsg_GetSubject(msg);
+    const char* cnatsReply = natsMsg_GetReply(msg);
 
+    subject = fromMsgBuffer(cnatsSubject, cnatsSubject ? int(qstrlen(cnatsSubject)) : 0, zeroCopy);
+    data = fromMsgBuffer(natsMsg_GetData(msg), natsMsg_GetDataLength(msg), zeroCopy);
+    reply = fromMsgBuffer(cnatsReply, cnatsReply ? int(qstrlen(cnatsReply)) : 0, zeroCopy);
+}
+
+void QtNats::decodeNatsHeaders(natsMsg* msg, MessageHeaders& headers)
+{
     const char** keys = nullptr;
     int keyCount = 0;
 
@@ -110,7 +135,69 @@ Message::Message(natsMsg* msg) noexcept:
     }
 
     free(keys);
-};
+}
+
+void IncomingMessage::parseHeaders()
+{
+    std::call_once(m_parsed, [this]() {
+        const char** keys = nullptr;
+        int keyCount = 0;
+        if (natsMsgHeader_Keys(msg, &keys, &keyCount) == NATS_OK) {
+            free(keys);
+        }
+    });
+}
+
+const MessageHeaders& IncomingMessage::headers()
+{
+    std::call_once(m_decoded, [this]() {
+        parseHeaders();
+        decodeNatsHeaders(msg, m_headers);
+    });
+    return m_headers;
+}
+
+QByteArray IncomingMessage::header(const QByteArray& key)
+{
+    parseHeaders();
+    const char* value = nullptr;
+    natsStatus s = natsMsgHeader_Get(msg, key.constData(), &value);
+    if (s != NATS_OK) {
+        return QByteArray();
+    }
+    return QByteArray(value);
+}
+
+natsMsg* Message::natsMessage() const
+{
+    return m_incoming ? m_incoming->msg : nullptr;
+}
+
+const MessageHeaders& Message::headers() const
+{
+    if (m_ownHeaders) {
+        return m_headers;
+    }
+    return m_incoming->headers();
+}
+
+MessageHeaders& Message::headers()
+{
+    if (!m_ownHeaders) {
+        // QMultiHash is implicitly shared, so this copy is cheap until it is modified
+        m_headers = m_incoming->headers();
+        m_ownHeaders = true;
+    }
+    return m_headers;
+}
+
+QByteArray Message::header(const QByteArray& key) const
+{
+    if (m_ownHeaders) {
+        return m_headers.value(key);
+    }
+    return m_incoming->header(key);
+}
 
 NatsMsgPtr QtNats::toNatsMsg(const Message& msg, const char* reply)
 {
@@ -133,43 +220,197 @@ NatsMsgPtr QtNats::toNatsMsg(const Message& msg, const char* reply)
     
     NatsMsgPtr msgPtr(cnatsMsg, &natsMsg_Destroy);
 
-    auto i = msg.headers.constBegin();
-    while (i != msg.headers.constEnd()) {
+    const MessageHeaders& headers = msg.headers();
+    for (auto i = headers.constBegin(); i != headers.constEnd(); ++i) {
         checkError(natsMsgHeader_Add(cnatsMsg, i.key().constData(), i.value().constData()));
     }
     return msgPtr;
 }
 
+void QtNats::publishMessage(natsConnection* conn, const Message& msg, const char* reply)
+{
+    if (!msg.headers().isEmpty()) {
+        NatsMsgPtr p = toNatsMsg(msg, reply);
+        checkError(natsConnection_PublishMsg(conn, p.get()));
+        return;
+    }
+
+    if (!reply && msg.reply.size()) {
+        reply = msg.reply.constData();
+    }
+    natsStatus s;
+    if (reply) {
+        s = natsConnection_PublishRequest(conn, msg.subject.constData(), reply, msg.data.constData(), msg.data.size());
+    }
+    else {
+        s = natsConnection_Publish(conn, msg.subject.constData(), msg.data.constData(), msg.data.size());
+    }
+    checkError(s);
+}
+
 void QtNats::subscriptionCallback(natsConnection* /*nc*/, natsSubscription* /*sub*/, natsMsg* msg, void* closure) {
     Subscription* sub = reinterpret_cast<Subscription*>(closure);
     
-    Message m(msg);
+    Message m(msg, sub->m_zeroCopy);
+    m.m_ackConnection = sub->m_ackConnection;
+    m.m_ackTimeout = sub->m_ackTimeout;
+    if (sub->m_callback) {
+        sub->m_callback(std::move(m));
+        return;
+    }
+    DeliveryQueue* queue = sub->m_batchQueue.load(std::memory_order_acquire);
+    if (queue) {
+        sub->enqueue(queue, std::move(m));
+        return;
+    }
     emit sub->received(m);
 }
 
-static void asyncRequestCallback(natsConnection* /*nc*/, natsSubscription* natsSub, natsMsg* msg, void* closure) {
-    auto future_iface = reinterpret_cast<QFutureInterface<Message>*>(closure);
+namespace {
+    // a response to asyncRequest on the shared inbox
+    class AsyncRequest : public ResponseHandler
+    {
+    public:
+        AsyncRequest(bool zeroCopy, std::atomic<quint64>* failedRequestCount, LatencyHistogram* latency) :
+            m_zeroCopy(zeroCopy),
+            m_failedRequestCount(failedRequestCount),
+            m_latency(latency)
+        {
+            m_timer.start();
+        }
 
-    if (msg) {
-        if (natsMsg_IsNoResponders(msg)) {
-            future_iface->reportException(Exception(NATS_NO_RESPONDERS));
-            natsMsg_Destroy(msg);
+        bool deliver(natsMsg* msg) override
+        {
+            if (!tryFinish()) {
+                natsMsg_Destroy(msg);
+                return true;
+            }
+            if (promise.isCanceled()) {
+                natsMsg_Destroy(msg);
+            }
+            else if (natsMsg_IsNoResponders(msg)) {
+                natsMsg_Destroy(msg);
+                (*m_failedRequestCount)++;
+                promise.setException(Exception(NATS_NO_RESPONDERS));
+            }
+            else {
+                m_latency->record(m_timer.nsecsElapsed());
+                promise.addResult(Message(msg, m_zeroCopy));
+            }
+            promise.finish();
+            return true;
         }
-        else {
-            Message m(msg);
-            future_iface->reportResult(m);
+
+        void expire(natsStatus status) override
+        {
+            if (!tryFinish()) {
+                return;
+            }
+            // a cancelled future only needs to be finished, so that waitForFinished() returns
+            if (!promise.isCanceled()) {
+                (*m_failedRequestCount)++;
+                promise.setException(Exception(status));
+            }
+            promise.finish();
         }
-    }
-    else {
-        future_iface->reportException(Exception(NATS_TIMEOUT));
-    }
-    future_iface->reportFinished();
-    delete future_iface;
-    natsSubscription_Destroy(natsSub);
+
+        QFutureWatcherBase* watchCancel() override { return promise.watch(); }
+
+        Promise<Message> promise;
+
+    private:
+        const bool m_zeroCopy;
+        std::atomic<quint64>* const m_failedRequestCount;
+        LatencyHistogram* const m_latency;
+        QElapsedTimer m_timer;
+    };
+
+    // collects responses to requestMany on the shared inbox; a timeout or a stall just finishes it
+    class ScatterRequest : public ResponseHandler
+    {
+    public:
+        ScatterRequest(int maxReplies, bool zeroCopy, std::atomic<quint64>* failedRequestCount) :
+            m_maxReplies(maxReplies),
+            m_zeroCopy(zeroCopy),
+            m_failedRequestCount(failedRequestCount)
+        {}
+
+        bool deliver(natsMsg* msg) override
+        {
+            // a cancelled request is finished by ResponseMux
+            if (isFinished() || promise.isCanceled()) {
+                natsMsg_Destroy(msg);
+                return isFinished();
+            }
+            if (natsMsg_IsNoResponders(msg)) {
+                natsMsg_Destroy(msg);
+                if (tryFinish()) {
+                    (*m_failedRequestCount)++;
+                    promise.setException(Exception(NATS_NO_RESPONDERS));
+                    promise.finish();
+                }
+                return true;
+            }
+            promise.addResult(Message(msg, m_zeroCopy));
+            if (++m_received == m_maxReplies) {
+                if (tryFinish()) {
+                    promise.finish();
+                }
+                return true;
+            }
+            return false;
+        }
+
+        void expire(natsStatus status) override
+        {
+            if (!tryFinish()) {
+                return;
+            }
+            if (status != NATS_TIMEOUT && !promise.isCanceled()) {
+                (*m_failedRequestCount)++;
+                promise.setException(Exception(status));
+            }
+            promise.finish();
+        }
+
+        QFutureWatcherBase* watchCancel() override { return promise.watch(); }
+
+        Promise<Message> promise;
+
+    private:
+        const int m_maxReplies;
+        const bool m_zeroCopy;
+        std::atomic<quint64>* const m_failedRequestCount;
+        int m_received = 0; // deliver() is never called concurrently
+    };
 }
 
-static void errorHandler(natsConnection* /*nc*/, natsSubscription* /*subscription*/, natsStatus err, void* closure) {
+static QMutex subscriptionsMutex;
+static QHash<natsSubscription*, Subscription*> subscriptions;
+
+void QtNats::registerSubscription(natsSubscription* natsSub, Subscription* sub)
+{
+    QMutexLocker locker(&subscriptionsMutex);
+    subscriptions.insert(natsSub, sub);
+}
+
+void QtNats::unregisterSubscription(natsSubscription* natsSub)
+{
+    QMutexLocker locker(&subscriptionsMutex);
+    subscriptions.remove(natsSub);
+}
+
+static void errorHandler(natsConnection* /*nc*/, natsSubscription* subscription, natsStatus err, void* closure) {
     Client* c = reinterpret_cast<Client*>(closure);
+    if (err == NATS_SLOW_CONSUMER && subscription) {
+        // the lock only keeps the Subscription alive while the event is posted; the signal is emitted in its thread,
+        // and the event is dropped if the Subscription is destroyed before that
+        QMutexLocker locker(&subscriptionsMutex);
+        Subscription* sub = subscriptions.value(subscription);
+        if (sub) {
+            QMetaObject::invokeMethod(sub, [sub]() { emit sub->slowConsumer(); }, Qt::QueuedConnection);
+        }
+    }
     emit c->errorOccurred(err, getNatsErrorText(err));
 }
 
@@ -194,10 +435,6 @@ Client::Client(QObject* parent):
     QObject(parent),
     semaphore(1)
 {
-    int cpuCoresCount = QThread::idealThreadCount(); //this function may fail, thus the check
-    if (cpuCoresCount >= 2) {
-        nats_SetMessageDeliveryPoolSize(cpuCoresCount);
-    }
 }
 
 Client::~Client()
@@ -211,17 +448,29 @@ void Client::connectToServer(const Options& opts)
     natsOptions* nats_opts = buildNatsOptions(opts);
     NatsOptsPtr optsPtr(nats_opts, &natsOptions_Destroy);
 
-    //don't create a thread for each subscription, since we may have a lot of subscriptions
-    //number of threads in the pool is set by nats_SetMessageDeliveryPoolSize above
-    natsOptions_UseGlobalMessageDelivery(nats_opts, true);
+    //by default don't create a thread for each subscription, since we may have a lot of subscriptions
+    if (opts.globalMessageDelivery) {
+        int poolSize = opts.deliveryPoolSize;
+        if (poolSize <= 0) {
+            poolSize = QThread::idealThreadCount(); //this function may fail, thus the check
+        }
+        if (poolSize >= 1) {
+            checkError(nats_SetMessageDeliveryPoolSize(poolSize));
+        }
+    }
+    natsOptions_UseGlobalMessageDelivery(nats_opts, opts.globalMessageDelivery);
 
     natsOptions_SetErrorHandler(nats_opts, &errorHandler, this);
     natsOptions_SetClosedCB(nats_opts, &closedConnectionHandler, this);
     natsOptions_SetDisconnectedCB(nats_opts, &disconnectedHandler, this);
     natsOptions_SetReconnectedCB(nats_opts, &reconnectedHandler, this);
 
+    m_zeroCopy = opts.zeroCopyMessages;
+
     emit statusChanged(ConnectionStatus::Connecting);
     checkError(natsConnection_Connect(&m_conn, nats_opts));
+    m_responseMux = new ResponseMux(m_conn);
+    m_ackConnection = std::make_shared<AckConnection>(m_conn, m_responseMux);
     emit statusChanged(ConnectionStatus::Connected);
     //TODO handle reopening
 }
@@ -238,6 +487,18 @@ void Client::close() noexcept
     if (!m_conn) {
         return;
     }
+    // the timer would keep polling the destroyed connection
+    delete m_statisticsTimer;
+    m_statisticsTimer = nullptr;
+    // service endpoints still need the connection to reply to requests in progress
+    for (ServiceEndpoint* endpoint : findChildren<ServiceEndpoint*>()) {
+        endpoint->stop();
+    }
+    // pulled messages can't acknowledge themselves anymore; waits for their acks in progress
+    m_ackConnection->reset();
+    // fails pending asyncRequests
+    delete m_responseMux;
+    m_responseMux = nullptr;
     //sync this thread with closedConnectionHandler otherwise I get a crash when trying to emit c->statusChanged(ConnectionStatus::Closed);
     semaphore.acquire();
     natsConnection_Close(m_conn);
@@ -248,53 +509,142 @@ void Client::close() noexcept
 }
 
 void Client::publish(const Message& msg) {
-    NatsMsgPtr p = toNatsMsg(msg);
-    checkError(natsConnection_PublishMsg(m_conn, p.get()));
+    publishMessage(m_conn, msg);
+}
+
+void Client::publishBatch(const QList<Message>& messages, qint64 flushTimeout)
+{
+    publishBatch(messages.constBegin(), messages.constEnd(), flushTimeout);
+}
+
+// one PING/PONG round trip for the whole batch
+void Client::flush(qint64 timeout)
+{
+    checkError(natsConnection_FlushTimeout(m_conn, timeout));
 }
 
 Message Client::request(const Message& msg, qint64 timeout)
 {
     natsMsg* replyMsg;
-    NatsMsgPtr p = toNatsMsg(msg);
-    checkError(natsConnection_RequestMsg(&replyMsg, m_conn, p.get(), timeout));
-    return Message(replyMsg);
+    natsStatus s;
+    QElapsedTimer timer;
+    timer.start();
+    m_requestCount++;
+    if (msg.headers().isEmpty()) {
+        s = natsConnection_Request(&replyMsg, m_conn, msg.subject.constData(), msg.data.constData(), msg.data.size(), timeout);
+    }
+    else {
+        NatsMsgPtr p = toNatsMsg(msg);
+        s = natsConnection_RequestMsg(&replyMsg, m_conn, p.get(), timeout);
+    }
+    if (s != NATS_OK) {
+        m_failedRequestCount++;
+    }
+    checkError(s);
+    m_requestLatency.record(timer.nsecsElapsed());
+    return Message(replyMsg, m_zeroCopy);
 }
 
 QFuture<Message> Client::asyncRequest(const Message& msg, qint64 timeout)
 {
-    // QFutureInterface is undocumented; Qt6 provides QPromise instead
-    // based on https://stackoverflow.com/questions/59197694/qt-how-to-create-a-qfuture-from-a-thread
-    auto future_iface = std::make_unique<QFutureInterface<Message>>();
-    QByteArray inbox = Client::newInbox();
+    if (!m_responseMux) {
+        throw Exception(NATS_CONNECTION_CLOSED);
+    }
+    auto request = std::make_shared<AsyncRequest>(m_zeroCopy, &m_failedRequestCount, &m_requestLatency);
+    QFuture<Message> f = request->promise.future();
+    m_requestCount++;
+
+    QByteArray reply = m_responseMux->add(request, timeout);
+    try {
+        // can't do msg.reply = inbox; publish(msg); because "msg" is constant
+        publishMessage(m_conn, msg, reply.constData());
+    }
+    catch (...) {
+        m_responseMux->remove(reply);
+        throw;
+    }
+    return f;
+}
 
-    natsSubscription* subscription = nullptr;
-    
-    checkError(natsConnection_SubscribeTimeout(&subscription, m_conn, inbox.constData(), timeout, &asyncRequestCallback, future_iface.get()));
-    checkError(natsSubscription_AutoUnsubscribe(subscription, 1));
-    // can't do msg.reply = inbox; publish(msg); because "msg" is constant
-    NatsMsgPtr p = toNatsMsg(msg, inbox.constData());
-    checkError(natsConnection_PublishMsg(m_conn, p.get()));
-
-    future_iface->reportStarted();
-    auto f = future_iface->future();
-    future_iface.release(); //will be deleted in asyncRequestCallback
+QFuture<Message> Client::requestMany(const Message& msg, int maxReplies, qint64 timeout, qint64 stallTimeout)
+{
+    if (!m_responseMux) {
+        throw Exception(NATS_CONNECTION_CLOSED);
+    }
+    auto request = std::make_shared<ScatterRequest>(maxReplies, m_zeroCopy, &m_failedRequestCount);
+    QFuture<Message> f = request->promise.future();
+    m_requestCount++;
+
+    QByteArray reply = m_responseMux->add(request, timeout, stallTimeout);
+    try {
+        publishMessage(m_conn, msg, reply.constData());
+    }
+    catch (...) {
+        m_responseMux->remove(reply);
+        throw;
+    }
     return f;
 }
 
 Subscription* Client::subscribe(const QByteArray& subject)
 {
-    // avoid a memory leak if checkError throws
-    // can't use make_unique because Subscription's constructor is private
-    auto sub = std::unique_ptr<Subscription>(new Subscription(nullptr));
-    checkError(natsConnection_Subscribe(&sub->m_sub, m_conn, subject.constData(), &subscriptionCallback, sub.get()));
-    sub->setParent(this);
-    return sub.release();
+    return doSubscribe(subject, SubscribeOptions());
 }
 
 Subscription* Client::subscribe(const QByteArray& subject, const QByteArray& queueGroup)
 {
+    SubscribeOptions options;
+    options.queueGroup = queueGroup;
+    return doSubscribe(subject, options);
+}
+
+Subscription* Client::subscribe(const QByteArray& subject, MessageCallback callback)
+{
+    SubscribeOptions options;
+    options.callback = std::move(callback);
+    return doSubscribe(subject, options);
+}
+
+Subscription* Client::subscribe(const QByteArray& subject, const QByteArray& queueGroup, MessageCallback callback)
+{
+    SubscribeOptions options;
+    options.queueGroup = queueGroup;
+    options.callback = std::move(callback);
+    return doSubscribe(subject, options);
+}
+
+Subscription* Client::subscribe(const QByteArray& subject, const SubscribeOptions& options)
+{
+    return doSubscribe(subject, options);
+}
+
+Subscription* Client::doSubscribe(const QByteArray& subject, const SubscribeOptions& options)
+{
+    // avoid a memory leak if checkError throws
+    // can't use make_unique because Subscription's constructor is private
     auto sub = std::unique_ptr<Subscription>(new Subscription(nullptr));
-    checkError(natsConnection_QueueSubscribe(&sub->m_sub, m_conn, subject.constData(), queueGroup.constData(), &subscriptionCallback, sub.get()));
+    sub->m_subject = subject;
+    sub->m_zeroCopy = m_zeroCopy;
+    sub->m_callback = options.callback;
+    const char* queueGroup = options.queueGroup.isEmpty() ? nullptr : options.queueGroup.constData();
+
+    if (options.dedicatedThread) {
+        // a sync subscription, which is drained by our own thread
+        if (queueGroup) {
+            checkError(natsConnection_QueueSubscribeSync(&sub->m_sub, m_conn, subject.constData(), queueGroup));
+        }
+        else {
+            checkError(natsConnection_SubscribeSync(&sub->m_sub, m_conn, subject.constData()));
+        }
+        sub->startDeliveryThread(options.cpuAffinity);
+    }
+    else if (queueGroup) {
+        checkError(natsConnection_QueueSubscribe(&sub->m_sub, m_conn, subject.constData(), queueGroup, &subscriptionCallback, sub.get()));
+    }
+    else {
+        checkError(natsConnection_Subscribe(&sub->m_sub, m_conn, subject.constData(), &subscriptionCallback, sub.get()));
+    }
+    registerSubscription(sub->m_sub, sub.get());
     sub->setParent(this);
     return sub.release();
 }
@@ -339,5 +689,143 @@ QByteArray Client::newInbox()
 
 Subscription::~Subscription()
 {
+    unregisterSubscription(m_sub);
+    if (m_deliveryThread) {
+        m_stopDelivery = true;
+        natsSubscription_Unsubscribe(m_sub); // wakes up natsSubscription_NextMsg
+        m_deliveryThread->wait();
+        delete m_deliveryThread;
+    }
     natsSubscription_Destroy(m_sub);
+    delete m_batchQueue.load();
+}
+
+static void pinCurrentThread(int cpu)
+{
+#if defined(Q_OS_LINUX)
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+#elif defined(Q_OS_WIN)
+    SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+#else
+    Q_UNUSED(cpu);
+#endif
+}
+
+void Subscription::startDeliveryThread(int cpuAffinity)
+{
+    m_deliveryThread = QThread::create([this, cpuAffinity]() {
+        if (cpuAffinity >= 0) {
+            pinCurrentThread(cpuAffinity);
+        }
+        while (!m_stopDelivery) {
+            natsMsg* msg = nullptr;
+            natsStatus s = natsSubscription_NextMsg(&msg, m_sub, 1000);
+            if (s == NATS_OK) {
+                subscriptionCallback(nullptr, m_sub, msg, this);
+            }
+            else if (s != NATS_TIMEOUT && s != NATS_SLOW_CONSUMER) {
+                break; // the subscription or the connection is closed
+            }
+        }
+    });
+    m_deliveryThread->setObjectName("NATS delivery");
+    m_deliveryThread->start();
+}
+
+void Subscription::setPendingLimits(int maxMessages, int maxBytes)
+{
+    checkError(natsSubscription_SetPendingLimits(m_sub, maxMessages, maxBytes));
+}
+
+SubscriptionStatistics Subscription::statistics() const
+{
+    SubscriptionStatistics stats;
+    int64_t delivered = 0;
+    int64_t dropped = 0;
+    checkError(natsSubscription_GetStats(m_sub, &stats.pendingMessages, &stats.pendingBytes,
+        &stats.maxPendingMessages, &stats.maxPendingBytes, &delivered, &dropped));
+    checkError(natsSubscription_GetPendingLimits(m_sub, &stats.pendingMessagesLimit, &stats.pendingBytesLimit));
+    stats.subject = m_subject;
+    stats.sid = qint64(natsSubscription_GetID(m_sub));
+    stats.deliveredMessages = delivered;
+    stats.droppedMessages = dropped;
+    return stats;
+}
+
+void Subscription::measureDeliveryRate(SubscriptionStatistics& stats)
+{
+    if (m_rateTimer.isValid()) {
+        qint64 elapsed = m_rateTimer.restart();
+        if (elapsed > 0) {
+            stats.deliveryRate = double(stats.deliveredMessages - m_lastDelivered) * 1000 / elapsed;
+        }
+    }
+    else {
+        m_rateTimer.start();
+    }
+    m_lastDelivered = stats.deliveredMessages;
+}
+
+void Subscription::setBatchDelivery(int maxBatchSize, qint64 maxLatency)
+{
+    if (m_batchQueue.load() || maxBatchSize < 1) {
+        return;
+    }
+    auto queue = new DeliveryQueue(maxBatchSize, maxLatency);
+    queue->timer = new QTimer(this);
+    queue->timer->setSingleShot(true);
+    queue->timer->setInterval(int(maxLatency));
+    connect(queue->timer, &QTimer::timeout, this, &Subscription::emitBatch);
+    m_batchQueue.store(queue, std::memory_order_release);
+}
+
+// called from a cnats thread
+void Subscription::enqueue(DeliveryQueue* queue, Message&& msg)
+{
+    // count first, so that the consumer never sees fewer messages than the queue holds
+    int size = ++queue->size;
+    queue->messages.push(std::move(msg));
+    // wake up the receiving thread only when a batch starts or fills up
+    if (size == 1 || size == queue->maxBatchSize) {
+        QMetaObject::invokeMethod(this, [this]() { scheduleBatch(); }, Qt::QueuedConnection);
+    }
+}
+
+void Subscription::scheduleBatch()
+{
+    DeliveryQueue* queue = m_batchQueue.load(std::memory_order_acquire);
+    if (queue->size.load() >= queue->maxBatchSize || queue->maxLatency <= 0) {
+        queue->timer->stop();
+        emitBatch();
+    }
+    else if (!queue->timer->isActive()) {
+        queue->timer->start();
+    }
+}
+
+void Subscription::emitBatch()
+{
+    DeliveryQueue* queue = m_batchQueue.load(std::memory_order_acquire);
+    QVector<Message> batch;
+    batch.reserve(qMin(queue->size.load(), queue->maxBatchSize));
+    Message msg;
+    while (batch.size() < queue->maxBatchSize && queue->messages.pop(msg)) {
+        batch.append(std::move(msg));
+    }
+    int remaining = queue->size.fetch_sub(batch.size()) - batch.size();
+    if (batch.size()) {
+        emit receivedBatch(batch);
+    }
+    // the producer won't wake us up again until the queue is drained or a new batch is full
+    if (remaining > 0) {
+        if (remaining >= queue->maxBatchSize || queue->maxLatency <= 0) {
+            QMetaObject::invokeMethod(this, [this]() { emitBatch(); }, Qt::QueuedConnection);
+        }
+        else if (!queue->timer->isActive()) {
+            queue->timer->start();
+        }
+    }
 }
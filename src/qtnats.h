@@ -6,19 +6,33 @@ Unless required by applicable law or agreed to in writing, software distributed
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <functional>
 #include <memory>
 
 #include <QObject>
 // I've received the clarification that Latin-1 should be used everywhere for strings, so QByteArray is clearer API than QString
 // https://github.com/nats-io/nats.c/issues/573
 #include <QByteArray>
+#include <QDateTime>
+#include <QElapsedTimer>
 #include <QFuture>
+#include <QMap>
 #include <QUrl>
 #include <QMultiHash>
+#include <QMutex>
 #include <QSemaphore>
+#include <QThread>
+#include <QVector>
 
 #include <nats.h>
 
+class QCryptographicHash;
+class QIODevice;
+class QTimer;
+class QThreadPool;
+
 #include "qtnats_export.h"
 
 namespace QtNats {
@@ -27,6 +41,9 @@ namespace QtNats {
 
     using MessageHeaders = QMultiHash<QByteArray, QByteArray>;
 
+    class IncomingMessage;
+    class AckConnection;
+
     enum class ConnectionStatus
     {
         Disconnected = NATS_CONN_STATUS_DISCONNECTED,
@@ -40,6 +57,14 @@ namespace QtNats {
 
     Q_ENUM_NS(ConnectionStatus)
 
+    enum class FlushPolicy
+    {
+        Coalesced, // published messages are buffered and written to the socket by the cnats flusher thread
+        SendAsap   // every publish writes to the socket immediately in the calling thread
+    };
+
+    Q_ENUM_NS(FlushPolicy)
+
     // need to throw it from QFuture; otherwise it would be derived from std::runtime_error
     // in fact, QException inherits from std::exception, although it's not documented
     class Exception : public QException
@@ -92,6 +117,16 @@ namespace QtNats {
         int reconnectBufferSize;
         int maxPendingMessages;
         bool echo = true; //NB! reverted option
+        FlushPolicy flushPolicy = FlushPolicy::Coalesced;
+        // if true, subscriptions share the cnats delivery thread pool; otherwise cnats creates a thread for every subscription
+        bool globalMessageDelivery = true;
+        // size of the cnats delivery thread pool; 0 means QThread::idealThreadCount()
+        // NB! the pool is shared by all clients in the process and can only grow
+        int deliveryPoolSize = 0;
+        // if true, subject, reply and data of incoming messages point directly into the cnats message buffer instead of being copied
+        // the buffer is kept alive by all copies of the Message; QByteArray detaches (copies) it only when modified
+        // NB! do not keep a QByteArray taken from such a Message after the last copy of the Message is gone
+        bool zeroCopyMessages = false;
 
         Options();
     };
@@ -100,35 +135,181 @@ namespace QtNats {
     {
         Message() {}
         Message(const QByteArray& in_subject, const QByteArray& in_data) : subject(in_subject), data(in_data) {}
-        explicit Message(natsMsg* cmsg) noexcept;
-        bool isIncoming() const { return bool(m_natsMsg); }
+        explicit Message(natsMsg* cmsg, bool zeroCopy = false) noexcept;
+        bool isIncoming() const { return bool(m_incoming); }
 
         // JetStream acknowledgments
         void ack();
+        // doesn't wait for the server to confirm the ack
+        void ackNoWait();
+        // the future finishes when the server has confirmed the ack
+        // only for messages of JetStream::subscribe and PullSubscription::fetchAsync or consume; throws Exception(NATS_ILLEGAL_STATE) otherwise
+        QFuture<void> ackAsync(qint64 timeout = 5000);
         void nack(qint64 delay = -1); //ms
         void inProgress();
         void terminate();
 
 
+        // NB! 1. headers are case-sensitive
+        // 2. cnats does NOT preserve the order of headers
+        // 3. headers used to be a public member; they are a function now, so that they can be decoded only on first access
+        const MessageHeaders& headers() const;
+        MessageHeaders& headers();
+        // looks up a single header without decoding the others; returns the first value or an empty QByteArray
+        QByteArray header(const QByteArray& key) const;
+
         QByteArray subject;
         QByteArray reply;
         QByteArray data;
-        // NB! 1. headers are case-sensitive
-        // 2. cnats does NOT preserve the order of headers
-        MessageHeaders headers;
         
     private:
-        std::shared_ptr<natsMsg> m_natsMsg;
+        natsMsg* natsMessage() const;
+        void sendAck(const char* ackType, bool sync);
+
+        // the natsMsg and its decoded headers are shared by all copies of an incoming message
+        std::shared_ptr<IncomingMessage> m_incoming;
+        // m_headers replace the shared ones when this copy is modified through headers()
+        MessageHeaders m_headers;
+        bool m_ownHeaders = true;
+        // set for JetStream messages pulled by qtnats or pushed to JetStream::subscribe; they are acknowledged with the same protocol as in cnats, but without a round trip if possible
+        // other messages are acknowledged by cnats
+        std::shared_ptr<AckConnection> m_ackConnection;
+        qint64 m_ackTimeout = 0; // ms for ack(); the timeout of the JetStream
+        friend class PullRequest;
+        friend void subscriptionCallback(natsConnection* nc, natsSubscription* sub, natsMsg* msg, void* closure);
     };
 
     class Subscription;
     class JetStream;
+    class DeliveryQueue;
+    class ResponseMux;
+    class ServiceEndpoint;
+    class ServiceTask;
+    class AsyncPublishWindow;
+    class JetStreamGuard;
+    class PullConsumer;
+    class PullRequest;
+    class KeyValueCache;
+    class StreamReceiver;
+    class ChunkPuller;
+
+    // invoked directly in a cnats delivery thread, bypassing Qt signals; must not throw
+    using MessageCallback = std::function<void(Message&&)>;
+
+    struct SubscribeOptions
+    {
+        QByteArray queueGroup;
+        MessageCallback callback;
+        // deliver messages in a thread owned by this subscription instead of the cnats delivery thread(s)
+        bool dedicatedThread = false;
+        // pin the dedicated thread to this CPU core; -1 means no pinning (supported on Linux and Windows)
+        int cpuAffinity = -1;
+    };
     
+    // processes a request in a worker thread and returns the reply; the reply's subject is ignored
+    // if it throws std::exception, the reply has the Nats-Service-Error header set to what()
+    using ServiceHandler = std::function<Message(const Message& request)>;
+
+    struct ServiceOptions
+    {
+        // 0 means QThread::idealThreadCount()
+        int workerThreads = 0;
+        // requests taken by workers, but not replied yet; further requests wait in the subscription's pending queue
+        // 0 means workerThreads
+        int maxInFlight = 0;
+    };
+
+    // resubmits asynchronously published JetStream messages that timed out or found JetStream temporarily unavailable
+    struct JsRetryPolicy
+    {
+        int maxAttempts = 1; // including the first one; 1 means no retries
+        qint64 initialBackoff = 100; // ms
+        double backoffMultiplier = 2;
+        qint64 maxBackoff = 5000; // ms
+        // add a unique Nats-Msg-Id header if the message has none, so that the server drops duplicates
+        bool autoMsgId = true;
+    };
+
     struct JsOptions
     {
         // QString prefix = "$JS.API"; don't think it's a good idea to change this?
         QByteArray domain;
         qint64 timeout = 5000;
+        // max number of asynchronously published messages waiting for an ack
+        int maxPendingAsync = 4000;
+        // how long asyncPublish waits for a free slot when the window is full, ms
+        qint64 stallWait = 200;
+        JsRetryPolicy retry;
+    };
+
+    // chunked transfer of a QIODevice with Client::sendStream or JetStream::publishStream
+    struct StreamOptions
+    {
+        int chunkSize = 0; // bytes; 0 means as large as the server's max payload allows
+        int window = 8; // chunks sent and not acknowledged yet
+        qint64 timeout = 5000; // ms for every chunk
+    };
+
+    struct SubscriptionStatistics
+    {
+        QByteArray subject;
+        qint64 sid = 0; // tells apart several subscriptions on the same subject
+        int pendingMessages = 0;
+        int pendingBytes = 0;
+        int maxPendingMessages = 0; // high-water mark
+        int maxPendingBytes = 0;
+        int pendingMessagesLimit = 0;
+        int pendingBytesLimit = 0;
+        qint64 deliveredMessages = 0;
+        qint64 droppedMessages = 0;
+        double deliveryRate = 0; // messages per second between the two latest Client::statisticsUpdated; always 0 from statistics()
+    };
+
+    struct QTNATS_EXPORT Statistics
+    {
+        quint64 inMessages = 0;
+        quint64 inBytes = 0;
+        quint64 outMessages = 0;
+        quint64 outBytes = 0;
+        quint64 reconnects = 0;
+        int bufferedBytes = 0; // published, but not flushed to the socket yet
+        quint64 requests = 0;
+        quint64 failedRequests = 0;
+        QList<SubscriptionStatistics> subscriptions;
+
+        // text exposition format of Prometheus; every metric name starts with the prefix
+        QByteArray toPrometheus(const QByteArray& prefix = "nats") const;
+    };
+
+    // log-linear histogram of durations in nanoseconds, in the spirit of HdrHistogram: values are exact below 32 ns
+    // and otherwise fall into buckets with ~3% relative width; recording is lock-free and takes a few atomic increments
+    class QTNATS_EXPORT LatencyHistogram
+    {
+    public:
+        LatencyHistogram() noexcept;
+        LatencyHistogram(const LatencyHistogram& other) noexcept;
+        LatencyHistogram& operator=(const LatencyHistogram& other) noexcept;
+
+        void record(qint64 nanoseconds) noexcept;
+        void merge(const LatencyHistogram& other) noexcept;
+        void reset() noexcept;
+
+        quint64 count() const noexcept;
+        qint64 max() const noexcept;
+        // e.g. percentile(99.9); returns the highest value equivalent to the bucket containing the percentile
+        qint64 percentile(double percent) const noexcept;
+
+    private:
+        static constexpr int SubBucketBits = 5;
+        static constexpr int SubBucketCount = 1 << SubBucketBits;
+        static constexpr int BucketCount = (64 - SubBucketBits) * SubBucketCount;
+
+        static int indexOf(quint64 value) noexcept;
+        static qint64 highestValueAt(int index) noexcept;
+
+        std::array<std::atomic<quint64>, BucketCount> m_counts;
+        std::atomic<quint64> m_total;
+        std::atomic<qint64> m_max;
     };
 
     class QTNATS_EXPORT Client : public QObject
@@ -147,12 +328,31 @@ namespace QtNats {
         void close() noexcept;
         
         void publish(const Message& msg);
+        // publishes all messages without waiting for the server; cnats has no call to write a whole batch under one lock,
+        // so with FlushPolicy::Coalesced the batch is buffered and written out by the cnats flusher
+        // with flushTimeout > 0, it also waits for a PING/PONG round trip, so that the whole batch has reached the server when it returns,
+        // and throws Exception(NATS_TIMEOUT) if the server doesn't answer within flushTimeout ms; the batch has been sent anyway
+        // if publishing fails midway, the messages before the failed one are already sent
+        void publishBatch(const QList<Message>& messages, qint64 flushTimeout = 0);
+        template<typename InputIt>
+        void publishBatch(InputIt first, InputIt last, qint64 flushTimeout = 0);
 
         Message request(const Message& msg, qint64 timeout = 2000);
         QFuture<Message> asyncRequest(const Message& msg, qint64 timeout = 2000);
+        // scatter-gather: every reply is a separate result of the future
+        // it finishes after maxReplies replies (0 = unlimited), after timeout ms or when no reply came within stallTimeout ms after the previous one
+        QFuture<Message> requestMany(const Message& msg, int maxReplies, qint64 timeout = 2000, qint64 stallTimeout = 0);
+
+        // replies to requests on the subject with handler's return value; queueGroup may be empty
+        ServiceEndpoint* serve(const QByteArray& subject, const QByteArray& queueGroup, ServiceHandler handler,
+            const ServiceOptions& options = ServiceOptions());
 
         Subscription* subscribe(const QByteArray& subject);
         Subscription* subscribe(const QByteArray& subject, const QByteArray& queueGroup);
+        // messages are passed to the callback instead of the Subscription's signals
+        Subscription* subscribe(const QByteArray& subject, MessageCallback callback);
+        Subscription* subscribe(const QByteArray& subject, const QByteArray& queueGroup, MessageCallback callback);
+        Subscription* subscribe(const QByteArray& subject, const SubscribeOptions& options);
 
         bool ping(qint64 timeout = 10000) noexcept; //ms
         
@@ -161,22 +361,64 @@ namespace QtNats {
         QString errorString() const;
 
         static QByteArray newInbox();
+        // the largest message the server accepts, in bytes
+        qint64 maxPayload() const;
+
+        // splits the contents of source into chunks and sends them as requests to a StreamReceiver on the subject
+        // blocks until all chunks are acknowledged; returns the number of bytes sent
+        qint64 sendStream(const QByteArray& subject, QIODevice* source, const StreamOptions& options = StreamOptions());
+        // writes chunks sent with sendStream to sink; call it from the thread that owns sink
+        StreamReceiver* receiveStream(const QByteArray& subject, QIODevice* sink);
 
         JetStream* jetStream(const JsOptions& options = JsOptions());
 
         natsConnection* getNatsConnection() const { return m_conn; }
 
+        // snapshot of the connection counters and of all subscriptions created by this Client
+        Statistics statistics() const;
+        // emit statisticsUpdated every interval ms; 0 stops it
+        void setStatisticsInterval(int interval);
+        // round-trip time of successful request and asyncRequest calls
+        LatencyHistogram requestLatency() const { return m_requestLatency; }
+
     signals:
         void errorOccurred(natsStatus error, const QString& text);
         void statusChanged(ConnectionStatus status);
+        void statisticsUpdated(const Statistics& stats);
 
     private:
         natsConnection* m_conn = nullptr;
         QSemaphore semaphore;
+        bool m_zeroCopy = false;
+        QTimer* m_statisticsTimer = nullptr;
+        std::atomic<quint64> m_requestCount { 0 };
+        std::atomic<quint64> m_failedRequestCount { 0 };
+        LatencyHistogram m_requestLatency;
+        ResponseMux* m_responseMux = nullptr;
+        std::shared_ptr<AckConnection> m_ackConnection; // for the JetStream messages and pullers, which may outlive this Client
 
         static void closedConnectionHandler(natsConnection* nc, void* closure);
+        void flush(qint64 timeout);
+        // the connection counters without subscriptions
+        Statistics connectionStatistics() const;
+        void emitStatistics();
+        Subscription* doSubscribe(const QByteArray& subject, const SubscribeOptions& options);
+
+        friend class JetStream;
+        friend class StreamReceiver;
     };
     
+    template<typename InputIt>
+    void Client::publishBatch(InputIt first, InputIt last, qint64 flushTimeout)
+    {
+        for (; first != last; ++first) {
+            publish(*first);
+        }
+        if (flushTimeout > 0) {
+            flush(flushTimeout);
+        }
+    }
+
     class QTNATS_EXPORT Subscription : public QObject
     {
         Q_OBJECT
@@ -187,15 +429,131 @@ namespace QtNats {
         Subscription(Subscription&&) = delete;
         Subscription& operator=(Subscription&&) = delete;
 
+        // switches to batched delivery: messages are emitted with receivedBatch instead of received
+        // a batch is emitted when it reaches maxBatchSize or maxLatency ms after its first message has arrived
+        // the receiving thread is woken up at most once per batch
+        // call it right after subscribing from the thread that owns the Subscription; it can't be switched off
+        void setBatchDelivery(int maxBatchSize, qint64 maxLatency = 0);
+
+        // messages beyond these limits are dropped and slowConsumer is emitted; -1 means unlimited
+        void setPendingLimits(int maxMessages, int maxBytes);
+        SubscriptionStatistics statistics() const;
+
     signals:
         void received(const Message& message);
+        void receivedBatch(const QVector<Message>& messages);
+        // pending limits were exceeded; emitted in the thread of the Subscription
+        void slowConsumer();
 
     private:
         Subscription(QObject* parent) : QObject(parent) {}
 
+        void enqueue(DeliveryQueue* queue, Message&& msg);
+        void scheduleBatch();
+        void emitBatch();
+        void startDeliveryThread(int cpuAffinity);
+        // called only by the statistics timer of the Client, so that statistics() has no side effects
+        void measureDeliveryRate(SubscriptionStatistics& stats);
+
         natsSubscription* m_sub = nullptr;
+        QByteArray m_subject;
+        bool m_zeroCopy = false;
+        MessageCallback m_callback;
+        std::atomic<DeliveryQueue*> m_batchQueue { nullptr };
+        QThread* m_deliveryThread = nullptr;
+        std::atomic<bool> m_stopDelivery { false };
+        // for SubscriptionStatistics::deliveryRate
+        qint64 m_lastDelivered = 0;
+        QElapsedTimer m_rateTimer;
+        // set by JetStream::subscribe, so that its messages support ackAsync
+        std::shared_ptr<AckConnection> m_ackConnection;
+        qint64 m_ackTimeout = 5000; // of the JetStream
         friend class Client;
         friend class JetStream;
+        friend void subscriptionCallback(natsConnection* nc, natsSubscription* sub, natsMsg* msg, void* closure);
+    };
+
+    struct ServiceStatistics
+    {
+        QByteArray subject;
+        QByteArray queueGroup;
+        quint64 requests = 0;
+        quint64 errors = 0; // the handler threw
+        int inFlight = 0;
+        LatencyHistogram processingTime; // time spent in the handler
+    };
+
+    class QTNATS_EXPORT ServiceEndpoint : public QObject
+    {
+        Q_OBJECT
+        Q_DISABLE_COPY(ServiceEndpoint)
+
+    public:
+        ~ServiceEndpoint() noexcept override;
+
+        // stops taking new requests and waits until the ones in progress are replied; called by Client::close()
+        void stop() noexcept;
+        ServiceStatistics statistics() const;
+
+    private:
+        ServiceEndpoint(QObject* parent) : QObject(parent) {}
+
+        void process(const Message& request) noexcept;
+
+        natsConnection* m_conn = nullptr;
+        QByteArray m_subject;
+        QByteArray m_queueGroup;
+        ServiceHandler m_handler;
+        Subscription* m_subscription = nullptr;
+        QThreadPool* m_pool = nullptr;
+        QSemaphore m_inFlight;
+        int m_maxInFlight = 0;
+        std::atomic<quint64> m_requests { 0 };
+        std::atomic<quint64> m_errors { 0 };
+        LatencyHistogram m_processingTime;
+        friend class Client;
+        friend class ServiceTask;
+    };
+
+    // reassembles chunks sent with Client::sendStream or JetStream::publishStream in the thread that owns it
+    // transfers are written to the sink one after another
+    class QTNATS_EXPORT StreamReceiver : public QObject
+    {
+        Q_OBJECT
+        Q_DISABLE_COPY(StreamReceiver)
+
+    public:
+        ~StreamReceiver() noexcept override;
+        StreamReceiver(StreamReceiver&&) = delete;
+        StreamReceiver& operator=(StreamReceiver&&) = delete;
+
+    signals:
+        void progress(qint64 bytesReceived);
+        // the whole transfer has been written, and its size and digest are correct
+        void finished(qint64 size);
+        // the current transfer is abandoned; the sink may contain a part of it
+        void errorOccurred(natsStatus error, const QString& text);
+
+    private:
+        StreamReceiver(QObject* parent) : QObject(parent) { reset(); }
+
+        void receiveChunk(const Message& chunk);
+        // returns an error text for the sender
+        QByteArray writeChunk(const Message& chunk);
+        void fail(const QString& text);
+        void reset();
+
+        Client* m_client = nullptr; // replies to the chunks of Client::sendStream
+        QIODevice* m_sink = nullptr;
+        QByteArray m_transferId;
+        quint64 m_nextChunk = 0;
+        qint64 m_bytes = 0;
+        QMap<quint64, Message> m_early; // chunks that have overtaken the next one
+        std::shared_ptr<QCryptographicHash> m_digest;
+        std::shared_ptr<ChunkPuller> m_puller; // of JetStream::receiveStream
+        friend class Client;
+        friend class JetStream;
+        friend class ChunkPuller;
     };
 
     // ---------------------------- JET STREAM -------------------------------
@@ -214,9 +572,20 @@ namespace QtNats {
     struct JsPublishAck
     {
         QByteArray stream;
-        quint64 sequence;
+        quint64 sequence = 0;
         QByteArray domain;
-        bool duplicate;
+        bool duplicate = false;
+    };
+
+    struct PullConsumeOptions
+    {
+        int batch = 100; // messages per pull request
+        int maxBytes = 0; // per pull request; 0 means no limit
+        int prefetch = 2; // pull requests kept outstanding
+        // pull requests are sent again when fewer messages than this are still requested; -1 means batch * (prefetch - 1)
+        int lowWaterMark = -1;
+        qint64 expires = 30000; // ms until the server ends a pull request
+        qint64 idleHeartbeat = 5000; // ms; 0 disables heartbeats
     };
 
     class QTNATS_EXPORT PullSubscription : public QObject
@@ -230,11 +599,190 @@ namespace QtNats {
         PullSubscription& operator=(PullSubscription&&) = delete;
 
         QList<Message> fetch(int batch = 1, qint64 timeout = 5000);
+        // doesn't block: the future gets up to batch messages or maxBytes bytes (0 = no limit), whatever has arrived within timeout ms,
+        // or fails with Exception(NATS_TIMEOUT) if there were none
+        QFuture<QList<Message>> fetchAsync(int batch = 1, int maxBytes = 0, qint64 timeout = 5000);
+
+        // keeps pulling messages in the background and emits received for each of them
+        // messages arrive on the Client's shared inbox, so received is emitted from its cnats thread
+        // acknowledge them there with ackNoWait or an AckBatcher: ack() blocks this thread, shared by all requests of the Client, for a round trip
+        void consume(const PullConsumeOptions& opts = PullConsumeOptions());
+        // the callback is invoked in the same thread instead of emitting received
+        void consume(MessageCallback callback, const PullConsumeOptions& opts = PullConsumeOptions());
+        // messages requested but not delivered yet are redelivered by the server after the consumer's AckWait
+        void stopConsuming() noexcept;
+
+    signals:
+        void received(const Message& message);
+        // consume() has stopped, e.g. because the consumer was deleted; NATS_MISSED_HEARTBEAT doesn't stop it
+        void errorOccurred(natsStatus error, const QString& text);
 
     private:
         PullSubscription(QObject* parent) : QObject(parent) {}
 
+        QByteArray nextSubject();
+
         natsSubscription* m_sub = nullptr;
+        bool m_zeroCopy = false;
+        // the Client's connection, which may be closed and destroyed before this subscription
+        std::shared_ptr<AckConnection> m_ackConnection;
+        QByteArray m_apiPrefix;
+        qint64 m_ackTimeout = 5000; // of the JetStream
+        QByteArray m_nextSubject; // $JS.API.CONSUMER.MSG.NEXT.<stream>.<consumer>; looked up on first use unless both names were given
+        std::shared_ptr<PullConsumer> m_consumer;
+        friend class JetStream;
+        friend class PullConsumer;
+    };
+
+    struct AckBatchOptions
+    {
+        int maxBatch = 100;
+        qint64 maxDelay = 10; // ms after the first ack of a batch; 0 sends every ack right away
+        // for consumers with AckPolicy All: only the message with the highest stream sequence of a batch is acknowledged
+        bool ackAll = false;
+    };
+
+    // collects acks from any thread and sends them without waiting for the server in batches
+    class QTNATS_EXPORT AckBatcher : public QObject
+    {
+        Q_OBJECT
+        Q_DISABLE_COPY(AckBatcher)
+
+    public:
+        // sends the remaining acks
+        ~AckBatcher() noexcept override;
+        AckBatcher(AckBatcher&&) = delete;
+        AckBatcher& operator=(AckBatcher&&) = delete;
+
+        void ack(const Message& msg);
+        void flush() noexcept;
+
+    signals:
+        void errorOccurred(natsStatus error, const QString& text);
+
+    private:
+        AckBatcher(QObject* parent) : QObject(parent) {}
+
+        AckBatchOptions m_opts;
+        QMutex m_mutex;
+        QVector<Message> m_pending;
+        QTimer* m_timer = nullptr;
+        friend class JetStream;
+    };
+
+    // ---------------------------- KEY-VALUE -------------------------------
+
+    struct KeyValueConfig
+    {
+        QByteArray bucket;
+        QByteArray description;
+        int history = 1; // revisions kept per key, up to 64
+        qint64 ttl = 0; // ms; 0 means forever
+        qint64 maxBytes = -1;
+        int maxValueSize = -1;
+        bool memoryStorage = false;
+        int replicas = 1;
+    };
+
+    enum class KeyValueOperation
+    {
+        Put,
+        Delete,
+        Purge
+    };
+
+    struct KeyValueEntry
+    {
+        QByteArray key;
+        QByteArray value;
+        quint64 revision = 0;
+        QDateTime created;
+        quint64 delta = 0; // how many revisions are newer than this one, when known
+        KeyValueOperation operation = KeyValueOperation::Put;
+    };
+
+    // delivers the current values of the watched keys, and then every change, from a thread of its own
+    class QTNATS_EXPORT KeyValueWatcher : public QObject
+    {
+        Q_OBJECT
+        Q_DISABLE_COPY(KeyValueWatcher)
+
+    public:
+        ~KeyValueWatcher() noexcept override;
+        KeyValueWatcher(KeyValueWatcher&&) = delete;
+        KeyValueWatcher& operator=(KeyValueWatcher&&) = delete;
+
+        void stop() noexcept;
+
+    signals:
+        void updated(const KeyValueEntry& entry);
+        // all values that existed when the watch started have been delivered
+        void initialValuesReceived();
+
+    private:
+        KeyValueWatcher(QObject* parent) : QObject(parent) {}
+
+        void run();
+
+        kvWatcher* m_watcher = nullptr;
+        QThread* m_thread = nullptr;
+        // used instead of the signals by the cache of KeyValue; nullptr marks the end of the initial values
+        std::function<void(const KeyValueEntry*)> m_handler;
+        friend class KeyValue;
+    };
+
+    class QTNATS_EXPORT KeyValue : public QObject
+    {
+        Q_OBJECT
+        Q_DISABLE_COPY(KeyValue)
+
+    public:
+        ~KeyValue() noexcept override;
+        KeyValue(KeyValue&&) = delete;
+        KeyValue& operator=(KeyValue&&) = delete;
+
+        // throws Exception(NATS_NOT_FOUND) if the key doesn't exist or has been deleted
+        KeyValueEntry get(const QByteArray& key) const;
+        // never uses the cache
+        KeyValueEntry get(const QByteArray& key, quint64 revision) const;
+
+        // return the revision of the new value
+        quint64 put(const QByteArray& key, const QByteArray& value);
+        // fails if the key already exists
+        quint64 create(const QByteArray& key, const QByteArray& value);
+        // fails if the latest revision of the key isn't lastRevision
+        quint64 update(const QByteArray& key, const QByteArray& value, quint64 lastRevision);
+        // deletes the key, but keeps its history; "delete" is a keyword
+        void remove(const QByteArray& key);
+        // deletes the key with its history
+        void purge(const QByteArray& key);
+
+        QList<QByteArray> keys() const;
+        QList<KeyValueEntry> history(const QByteArray& key) const;
+        // keys may contain wildcards
+        KeyValueWatcher* watch(const QByteArray& keys = ">", bool includeHistory = false);
+
+        // serves get(key) from process memory, kept up to date by a watcher of the whole bucket
+        // blocks until the current values are loaded; changes made through this KeyValue are visible in the cache right away,
+        // other changes after the watcher has seen them
+        void enableCache(qint64 timeout = 5000);
+        bool isCached() const { return bool(m_cache); }
+
+        QByteArray bucket() const { return m_bucket; }
+        kvStore* getKvStore() const { return m_kv; }
+
+    private:
+        KeyValue(QObject* parent) : QObject(parent) {}
+
+        void updateCache(const QByteArray& key, const QByteArray& value, quint64 revision);
+        void publishMarker(const QByteArray& key, KeyValueOperation operation);
+
+        kvStore* m_kv = nullptr;
+        JetStream* m_js = nullptr;
+        QByteArray m_bucket;
+        QByteArray m_putPrefix; // $KV.<bucket>. like in cnats
+        std::shared_ptr<KeyValueCache> m_cache;
+        KeyValueWatcher* m_cacheWatcher = nullptr;
         friend class JetStream;
     };
 
@@ -254,22 +802,64 @@ namespace QtNats {
         void asyncPublish(const Message& msg, const JsPublishOptions& opts);
         void asyncPublish(const Message& msg, qint64 timeout = -1);
         void waitForPublishCompleted(qint64 timeout = -1);
+        // finishes when all messages published asynchronously so far are acknowledged or failed
+        QFuture<void> publishCompleted();
+
+        // like asyncPublish, but every message gets its own future, which fails with JetStreamException if the message is rejected
+        QFuture<JsPublishAck> asyncPublishWithAck(const Message& msg, const JsPublishOptions& opts);
+        QFuture<JsPublishAck> asyncPublishWithAck(const Message& msg, qint64 timeout = -1);
 
         Subscription* subscribe(const QByteArray& subject, const QByteArray& stream, const QByteArray& consumer);
+        Subscription* subscribe(const QByteArray& subject, const QByteArray& stream, const QByteArray& consumer, MessageCallback callback);
         PullSubscription* pullSubscribe(const QByteArray& subject, const QByteArray& stream, const QByteArray& consumer);
+        // replays the stream in order through an ephemeral consumer without acks, starting at startSequence (1 is the first message) or startTime
+        // with an empty filterSubject, the stream must have a single subject
+        // cnats watches the sequence numbers and heartbeats, and recreates the consumer after a gap
+        Subscription* orderedReader(const QByteArray& stream, quint64 startSequence, const QByteArray& filterSubject = QByteArray(),
+            MessageCallback callback = MessageCallback());
+        Subscription* orderedReader(const QByteArray& stream, const QDateTime& startTime, const QByteArray& filterSubject = QByteArray(),
+            MessageCallback callback = MessageCallback());
+        // like Client::sendStream, but the chunks are stored in a stream, and every chunk has a Nats-Msg-Id
+        qint64 publishStream(const QByteArray& subject, QIODevice* source, const StreamOptions& options = StreamOptions());
+        // reads the chunks of publishStream from the stream through an ephemeral pull consumer, a few chunks at a time
+        StreamReceiver* receiveStream(const QByteArray& stream, const QByteArray& subject, QIODevice* sink, quint64 startSequence = 1);
+
+        KeyValue* createKeyValue(const KeyValueConfig& config);
+        // binds to an existing bucket
+        KeyValue* keyValue(const QByteArray& bucket);
+        void deleteKeyValue(const QByteArray& bucket);
+
+        // the timer of the AckBatcher runs in the thread of this JetStream
+        AckBatcher* ackBatcher(const AckBatchOptions& opts = AckBatchOptions());
 
         jsCtx* getJsContext() const { return m_jsCtx; }
+
+        // time until a successful publish is acknowledged by the server
+        LatencyHistogram publishLatency() const { return m_publishLatency; }
         
     signals:
         void errorOccurred(natsStatus error, jsErrCode jsErr, const QString& text, const Message& msg);
+        // the async publish window has reached maxPendingAsync; may be emitted from any thread
+        void publishWindowFull();
+        // the window has dropped to half of maxPendingAsync after publishWindowFull; emitted from a cnats thread
+        void publishWindowDrained();
 
     private:
         JetStream(QObject* parent) : QObject(parent) {}
 
         jsCtx* m_jsCtx = nullptr;
+        Client* m_client = nullptr;
+        qint64 m_timeout = 0;
+        QByteArray m_apiPrefix;
+        JsRetryPolicy m_retry;
+        bool m_zeroCopy = false;
+        LatencyHistogram m_publishLatency;
+        std::shared_ptr<AsyncPublishWindow> m_publishWindow;
+        std::shared_ptr<JetStreamGuard> m_guard;
         
         JsPublishAck doPublish(const Message& msg, jsPubOptions* opts);
-        void doAsyncPublish(const Message& msg, jsPubOptions* opts);
+        Subscription* doOrderedReader(const QByteArray& stream, jsSubOptions& subOpts, QByteArray filterSubject, MessageCallback callback);
+        QFuture<JsPublishAck> doAsyncPublish(const Message& msg, const JsPublishOptions& opts, bool emitErrors);
 
         friend class Client;
     };
@@ -278,3 +868,6 @@ namespace QtNats {
 }
 
 Q_DECLARE_METATYPE(QtNats::Message)
+Q_DECLARE_METATYPE(QtNats::Statistics)
+Q_DECLARE_METATYPE(QtNats::JsPublishAck)
+Q_DECLARE_METATYPE(QtNats::KeyValueEntry)
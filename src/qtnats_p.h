@@ -8,13 +8,357 @@ Unless required by applicable law or agreed to in writing, software distributed
 
 #include "qtnats.h"
 
+#include <mutex>
+
+#include <QElapsedTimer>
+#include <QFutureInterface>
+#include <QFutureWatcher>
+#include <QMultiMap>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QTimer>
+#include <QWaitCondition>
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+#include <QPromise>
+#endif
+
 namespace QtNats {
 
 	void checkError(natsStatus s);
 
 	using NatsMsgPtr = std::unique_ptr<natsMsg, decltype(&natsMsg_Destroy)>;
 
-	NatsMsgPtr toNatsMsg(const Message& msg, const char* reply = nullptr);
+	// exported only for bench_message
+	QTNATS_EXPORT NatsMsgPtr toNatsMsg(const Message& msg, const char* reply = nullptr);
+
+	// takes ownership of ack
+	QTNATS_EXPORT JsPublishAck fromJsPubAck(jsPubAck* ack);
+
+	// appends all headers of msg
+	void decodeNatsHeaders(natsMsg* msg, MessageHeaders& headers);
+
+	// the natsMsg of an incoming Message, shared by all copies of the Message, which may be used from several threads
+	// cnats parses the header block on the first lookup, so it is done exactly once; later lookups only read
+	class IncomingMessage
+	{
+	public:
+		explicit IncomingMessage(natsMsg* in_msg) : msg(in_msg) {}
+		~IncomingMessage() { natsMsg_Destroy(msg); }
+		IncomingMessage(const IncomingMessage&) = delete;
+		IncomingMessage& operator=(const IncomingMessage&) = delete;
+
+		const MessageHeaders& headers();
+		QByteArray header(const QByteArray& key);
+
+		natsMsg* const msg;
+
+	private:
+		void parseHeaders();
+
+		std::once_flag m_parsed;
+		std::once_flag m_decoded;
+		MessageHeaders m_headers;
+	};
+
+	// header-less messages are published straight from the QByteArray buffers without creating a natsMsg
+	void publishMessage(natsConnection* conn, const Message& msg, const char* reply = nullptr);
 
 	void subscriptionCallback(natsConnection* nc, natsSubscription* sub, natsMsg* msg, void* closure);
+
+	// lets the connection's error handler find the Subscription that is a slow consumer
+	void registerSubscription(natsSubscription* natsSub, Subscription* sub);
+	void unregisterSubscription(natsSubscription* natsSub);
+
+	// Vyukov's node-based MPSC queue: any thread may push, only one thread may pop
+	// pop() may miss a push that is still in progress, so the consumer must be woken up by the producer after push()
+	template<typename T>
+	class MpscQueue
+	{
+		struct Node
+		{
+			std::atomic<Node*> next { nullptr };
+			T value;
+		};
+
+	public:
+		MpscQueue() : m_head(new Node), m_tail(m_head.load()) {}
+		~MpscQueue()
+		{
+			while (m_tail) {
+				Node* next = m_tail->next.load();
+				delete m_tail;
+				m_tail = next;
+			}
+		}
+		MpscQueue(const MpscQueue&) = delete;
+		MpscQueue& operator=(const MpscQueue&) = delete;
+
+		void push(T&& value)
+		{
+			Node* node = new Node;
+			node->value = std::move(value);
+			Node* prev = m_head.exchange(node, std::memory_order_acq_rel);
+			prev->next.store(node, std::memory_order_release);
+		}
+
+		bool pop(T& value)
+		{
+			Node* next = m_tail->next.load(std::memory_order_acquire);
+			if (!next) {
+				return false;
+			}
+			value = std::move(next->value);
+			delete m_tail;
+			m_tail = next;
+			return true;
+		}
+
+	private:
+		std::atomic<Node*> m_head;
+		Node* m_tail;
+	};
+
+	// messages on their way from a cnats delivery thread to Subscription::receivedBatch
+	class DeliveryQueue
+	{
+	public:
+		DeliveryQueue(int in_maxBatchSize, qint64 in_maxLatency) : maxBatchSize(in_maxBatchSize), maxLatency(in_maxLatency) {}
+
+		MpscQueue<Message> messages;
+		std::atomic<int> size { 0 };
+		const int maxBatchSize;
+		const qint64 maxLatency;
+		QTimer* timer = nullptr; // used only in the Subscription's thread
+	};
+
+	// QPromise on Qt6, the undocumented QFutureInterface on Qt5
+	// continuations attached with QFuture::then() run synchronously in the thread calling finish()
+	template<typename T>
+	class Promise
+	{
+	public:
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+		Promise() { m_promise.start(); }
+		template<typename U>
+		void addResult(U&& value) { m_promise.addResult(std::forward<U>(value)); }
+		void setException(const QException& e) { m_promise.setException(e); }
+		void finish() { m_promise.finish(); }
+#else
+		Promise() { m_promise.reportStarted(); }
+		template<typename U>
+		void addResult(U&& value) { m_promise.reportResult(std::forward<U>(value)); }
+		void setException(const QException& e) { m_promise.reportException(e); }
+		void finish() { m_promise.reportFinished(); }
+#endif
+		QFuture<T> future() { return m_promise.future(); }
+		bool isCanceled() const { return m_promise.isCanceled(); }
+		// QFuture::cancel() reaches the watcher as a posted event, so it must live in a thread with an event loop
+		QFutureWatcherBase* watch()
+		{
+			auto watcher = new QFutureWatcher<T>();
+			watcher->setFuture(future());
+			return watcher;
+		}
+
+	private:
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+		QPromise<T> m_promise;
+#else
+		QFutureInterface<T> m_promise;
+#endif
+	};
+
+	// a request waiting for responses on the Client's shared inbox
+	class ResponseHandler
+	{
+	public:
+		virtual ~ResponseHandler() = default;
+		// takes ownership of msg; returns true if no more responses are expected
+		virtual bool deliver(natsMsg* msg) = 0;
+		// the deadline has passed, the request was cancelled or the connection is being closed
+		virtual void expire(natsStatus status) = 0;
+		// a new watcher of the future of the request, so that ResponseMux learns that it has been cancelled; nullptr if it can't be
+		virtual QFutureWatcherBase* watchCancel() { return nullptr; }
+
+	protected:
+		// deliver() and expire() may race, only the first caller of tryFinish() may complete the request
+		bool tryFinish() { return !m_finished.exchange(true); }
+		bool isFinished() const { return m_finished; }
+
+	private:
+		std::atomic<bool> m_finished { false };
+	};
+
+	// responses to all requests of a Client arrive on one wildcard subscription <inbox>.* instead of a subscription per request
+	// the subscription and the threads expiring requests are created on first use
+	class ResponseMux
+	{
+	public:
+		explicit ResponseMux(natsConnection* conn);
+		// fails all pending requests with NATS_CONNECTION_CLOSED
+		~ResponseMux();
+		ResponseMux(const ResponseMux&) = delete;
+		ResponseMux& operator=(const ResponseMux&) = delete;
+
+		// returns the reply subject for the request; no deadline if timeout <= 0
+		// with stallTimeout > 0, every response that doesn't complete the request moves the deadline to stallTimeout ms from now
+		QByteArray add(std::shared_ptr<ResponseHandler> handler, qint64 timeout, qint64 stallTimeout = 0);
+		// forgets the request without calling expire()
+		void remove(const QByteArray& replySubject);
+
+	private:
+		struct Entry
+		{
+			std::shared_ptr<ResponseHandler> handler;
+			qint64 deadline;
+			qint64 finalDeadline;
+			qint64 stallTimeout;
+			std::shared_ptr<QFutureWatcherBase> watcher; // deleted later in m_cancelThread
+		};
+
+		static void onMessage(natsConnection* nc, natsSubscription* sub, natsMsg* msg, void* closure);
+		static void onComplete(void* closure);
+		void start();
+		void expireLoop();
+		void removeToken(const QByteArray& token);
+		void rearm(const QByteArray& token);
+		void setDeadline(const QByteArray& token, Entry& e, qint64 deadline);
+		void canceled(const QByteArray& token);
+
+		natsConnection* const m_conn;
+		natsSubscription* m_sub = nullptr;
+		QByteArray m_prefix;
+		quint64 m_nextToken = 0;
+		QElapsedTimer m_clock;
+		QMutex m_mutex;
+		QWaitCondition m_wakeUp;
+		QHash<QByteArray, Entry> m_pending; // token -> request
+		QMultiMap<qint64, QByteArray> m_deadlines; // ms since m_clock started -> token
+		QVector<QByteArray> m_canceled; // tokens of cancelled requests, to be expired by m_expireThread
+		QThread* m_expireThread = nullptr;
+		QThread* m_cancelThread = nullptr; // only runs an event loop for the cancel watchers
+		bool m_stopping = false;
+		QSemaphore m_subCompleted;
+	};
+
+	// the connection and ResponseMux of a Client, shared by the JetStream messages acknowledged by qtnats, pull subscriptions and stream receivers
+	// they may outlive the Client: Client::close() resets it, and then their acks and pulls fail with NATS_CONNECTION_CLOSED
+	class AckConnection
+	{
+	public:
+		AckConnection(natsConnection* conn, ResponseMux* mux) : m_conn(conn), m_mux(mux) {}
+
+		// calls f(conn, mux); the Client can't be closed while f runs, but any number of acks may run in parallel
+		template<typename F>
+		void invoke(F f)
+		{
+			if (!tryInvoke(std::move(f))) {
+				throw Exception(NATS_CONNECTION_CLOSED);
+			}
+		}
+		// returns false instead of throwing after Client::close()
+		template<typename F>
+		bool tryInvoke(F f)
+		{
+			QReadLocker locker(&m_lock);
+			if (!m_conn) {
+				return false;
+			}
+			f(m_conn, m_mux);
+			return true;
+		}
+		// waits for the acks in progress
+		void reset()
+		{
+			QWriteLocker locker(&m_lock);
+			m_conn = nullptr;
+			m_mux = nullptr;
+		}
+
+	private:
+		QReadWriteLock m_lock;
+		natsConnection* m_conn;
+		ResponseMux* m_mux;
+	};
+
+	// a pull request sent by qtnats itself to $JS.API.CONSUMER.MSG.NEXT.<stream>.<consumer> with a reply subject on the Client's shared inbox
+	// the server replies with messages and status messages: 100 Idle Heartbeat, 404 No Messages, 408 Request Timeout, 409 ...
+	class PullRequest : public ResponseHandler
+	{
+	public:
+		PullRequest(std::shared_ptr<AckConnection> ackConnection, bool zeroCopy, qint64 ackTimeout) :
+			m_ackConnection(std::move(ackConnection)),
+			m_zeroCopy(zeroCopy),
+			m_ackTimeout(ackTimeout)
+		{}
+		bool deliver(natsMsg* msg) override;
+		void expire(natsStatus status) override { ended(status, QString::fromLatin1(natsStatus_GetText(status))); }
+
+		// expires and idleHeartbeat in ms
+		static QByteArray body(int batch, int maxBytes, qint64 expires, qint64 idleHeartbeat, bool noWait = false);
+
+	protected:
+		// returns true if no more messages are expected
+		virtual bool received(Message&& msg) = 0;
+		// the server has ended the request (NATS_OK), the deadline has passed (NATS_TIMEOUT) or it failed
+		virtual void ended(natsStatus status, const QString& text) = 0;
+
+	private:
+		const std::shared_ptr<AckConnection> m_ackConnection;
+		const bool m_zeroCopy;
+		const qint64 m_ackTimeout;
+	};
+
+	// asynchronous publishes may still wait for their acks when the JetStream is destroyed, so they reach it only through this
+	class JetStreamGuard
+	{
+	public:
+		explicit JetStreamGuard(JetStream* js) : m_js(js) {}
+
+		// calls f(js) unless the JetStream is destroyed; it can't be destroyed while f runs
+		template<typename F>
+		void invoke(F f)
+		{
+			QMutexLocker locker(&m_mutex);
+			if (m_js) {
+				f(m_js);
+			}
+		}
+		// called by ~JetStream
+		void reset()
+		{
+			QMutexLocker locker(&m_mutex);
+			m_js = nullptr;
+		}
+
+	private:
+		QMutex m_mutex;
+		JetStream* m_js;
+	};
+
+	// JetStream messages published asynchronously and not acknowledged yet
+	class AsyncPublishWindow
+	{
+	public:
+		AsyncPublishWindow(int maxPending, qint64 stallWait) : m_maxPending(maxPending), m_stallWait(stallWait) {}
+
+		// waits up to stallWait ms for a free slot and returns false if there is none
+		// becameFull is set when this message fills the window
+		bool acquire(bool& becameFull);
+		// drained is set when the window drops to the low-water mark after being full
+		void release(bool& drained);
+		// -1 means no timeout
+		bool waitForEmpty(qint64 timeout);
+		QFuture<void> completed();
+
+	private:
+		QMutex m_mutex;
+		QWaitCondition m_changed;
+		int m_pending = 0;
+		bool m_full = false;
+		const int m_maxPending;
+		const qint64 m_stallWait;
+		QList<std::shared_ptr<Promise<void>>> m_completionWaiters;
+	};
 }
@@ -0,0 +1,118 @@
+/* Copyright(c) 2022 Petro Kazmirchuk https://github.com/Kazmirchuk
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with the License.You may obtain a copy of the License at http ://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.See the License for the specific language governing permissions and  limitations under the License.
+*/
+
+#include "qtnats.h"
+#include "qtnats_p.h"
+
+#include <QRunnable>
+#include <QThreadPool>
+
+using namespace QtNats;
+
+namespace QtNats {
+    class ServiceTask : public QRunnable
+    {
+    public:
+        ServiceTask(ServiceEndpoint* endpoint, Message&& request) : m_endpoint(endpoint), m_request(std::move(request)) {}
+        void run() override { m_endpoint->process(m_request); }
+
+    private:
+        ServiceEndpoint* const m_endpoint;
+        const Message m_request;
+    };
+}
+
+ServiceEndpoint* Client::serve(const QByteArray& subject, const QByteArray& queueGroup, ServiceHandler handler, const ServiceOptions& options)
+{
+    auto endpoint = std::unique_ptr<ServiceEndpoint>(new ServiceEndpoint(nullptr));
+    ServiceEndpoint* e = endpoint.get();
+    e->m_conn = m_conn;
+    e->m_subject = subject;
+    e->m_queueGroup = queueGroup;
+    e->m_handler = std::move(handler);
+
+    int threads = options.workerThreads > 0 ? options.workerThreads : qMax(1, QThread::idealThreadCount());
+    e->m_maxInFlight = options.maxInFlight > 0 ? options.maxInFlight : threads;
+    e->m_inFlight.release(e->m_maxInFlight);
+    e->m_pool = new QThreadPool(e);
+    e->m_pool->setMaxThreadCount(threads);
+
+    SubscribeOptions subOptions;
+    subOptions.queueGroup = queueGroup;
+    // blocking in the callback stalls only this subscription, and requests queue up in its pending messages
+    subOptions.dedicatedThread = true;
+    subOptions.callback = [e](Message&& request) {
+        e->m_inFlight.acquire();
+        e->m_pool->start(new ServiceTask(e, std::move(request)));
+    };
+    e->m_subscription = doSubscribe(subject, subOptions);
+    e->m_subscription->setParent(e);
+
+    e->setParent(this);
+    return endpoint.release();
+}
+
+ServiceEndpoint::~ServiceEndpoint() noexcept
+{
+    stop();
+}
+
+void ServiceEndpoint::stop() noexcept
+{
+    // waits for the subscription's thread, which may be waiting for a free slot
+    delete m_subscription;
+    m_subscription = nullptr;
+    m_pool->waitForDone();
+}
+
+void ServiceEndpoint::process(const Message& request) noexcept
+{
+    QElapsedTimer timer;
+    timer.start();
+    m_requests++;
+
+    Message reply;
+    try {
+        reply = m_handler(request);
+    }
+    catch (const std::exception& e) {
+        m_errors++;
+        reply = Message();
+        reply.headers().insert("Nats-Service-Error", e.what());
+        reply.headers().insert("Nats-Service-Error-Code", "500");
+    }
+    catch (...) {
+        m_errors++;
+        reply = Message();
+        reply.headers().insert("Nats-Service-Error", "unknown error");
+        reply.headers().insert("Nats-Service-Error-Code", "500");
+    }
+    m_processingTime.record(timer.nsecsElapsed());
+
+    if (!request.reply.isEmpty()) {
+        reply.subject = request.reply;
+        reply.reply.clear();
+        try {
+            publishMessage(m_conn, reply);
+        }
+        catch (const Exception&) {
+            m_errors++; // e.g. the connection is closed
+        }
+    }
+    m_inFlight.release();
+}
+
+ServiceStatistics ServiceEndpoint::statistics() const
+{
+    ServiceStatistics stats;
+    stats.subject = m_subject;
+    stats.queueGroup = m_queueGroup;
+    stats.requests = m_requests.load(std::memory_order_relaxed);
+    stats.errors = m_errors.load(std::memory_order_relaxed);
+    stats.inFlight = m_maxInFlight - m_inFlight.available();
+    stats.processingTime = m_processingTime;
+    return stats;
+}
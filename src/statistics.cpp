@@ -0,0 +1,281 @@
+/* Copyright(c) 2022 Petro Kazmirchuk https://github.com/Kazmirchuk
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with the License.You may obtain a copy of the License at http ://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.See the License for the specific language governing permissions and  limitations under the License.
+*/
+
+#include "qtnats.h"
+#include "qtnats_p.h"
+
+#include <QTimer>
+#include <QtAlgorithms>
+
+using namespace QtNats;
+
+LatencyHistogram::LatencyHistogram() noexcept
+{
+    reset();
+}
+
+LatencyHistogram::LatencyHistogram(const LatencyHistogram& other) noexcept
+{
+    reset();
+    merge(other);
+}
+
+LatencyHistogram& LatencyHistogram::operator=(const LatencyHistogram& other) noexcept
+{
+    if (this != &other) {
+        reset();
+        merge(other);
+    }
+    return *this;
+}
+
+int LatencyHistogram::indexOf(quint64 value) noexcept
+{
+    if (value < SubBucketCount) {
+        return int(value);
+    }
+    int msb = 63 - int(qCountLeadingZeroBits(value));
+    int bucket = msb - SubBucketBits + 1;
+    int subBucket = int(value >> (msb - SubBucketBits)) - SubBucketCount;
+    return bucket * SubBucketCount + subBucket;
+}
+
+qint64 LatencyHistogram::highestValueAt(int index) noexcept
+{
+    int bucket = index / SubBucketCount;
+    qint64 subBucket = index % SubBucketCount;
+    if (bucket == 0) {
+        return subBucket;
+    }
+    qint64 lowest = (SubBucketCount + subBucket) << (bucket - 1);
+    return lowest + ((qint64(1) << (bucket - 1)) - 1);
+}
+
+void LatencyHistogram::record(qint64 nanoseconds) noexcept
+{
+    if (nanoseconds < 0) {
+        nanoseconds = 0;
+    }
+    m_counts[indexOf(quint64(nanoseconds))].fetch_add(1, std::memory_order_relaxed);
+    m_total.fetch_add(1, std::memory_order_relaxed);
+    qint64 currentMax = m_max.load(std::memory_order_relaxed);
+    while (nanoseconds > currentMax && !m_max.compare_exchange_weak(currentMax, nanoseconds, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) noexcept
+{
+    for (int i = 0; i < BucketCount; i++) {
+        quint64 c = other.m_counts[i].load(std::memory_order_relaxed);
+        if (c) {
+            m_counts[i].fetch_add(c, std::memory_order_relaxed);
+        }
+    }
+    m_total.fetch_add(other.m_total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    qint64 otherMax = other.m_max.load(std::memory_order_relaxed);
+    qint64 currentMax = m_max.load(std::memory_order_relaxed);
+    while (otherMax > currentMax && !m_max.compare_exchange_weak(currentMax, otherMax, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::reset() noexcept
+{
+    for (auto& c : m_counts) {
+        c.store(0, std::memory_order_relaxed);
+    }
+    m_total.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+quint64 LatencyHistogram::count() const noexcept
+{
+    return m_total.load(std::memory_order_relaxed);
+}
+
+qint64 LatencyHistogram::max() const noexcept
+{
+    return m_max.load(std::memory_order_relaxed);
+}
+
+qint64 LatencyHistogram::percentile(double percent) const noexcept
+{
+    quint64 total = count();
+    if (total == 0) {
+        return 0;
+    }
+    percent = qBound(0.0, percent, 100.0);
+    quint64 rank = qMax<quint64>(1, quint64(percent / 100 * total + 0.5));
+    quint64 seen = 0;
+    for (int i = 0; i < BucketCount; i++) {
+        seen += m_counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return qMin(highestValueAt(i), max());
+        }
+    }
+    return max();
+}
+
+// need to pass it through queued signal-slot connections
+static const int statisticsTypeId = qRegisterMetaType<Statistics>();
+
+Statistics Client::connectionStatistics() const
+{
+    Statistics result;
+
+    natsStatistics* stats = nullptr;
+    checkError(natsStatistics_Create(&stats));
+    std::unique_ptr<natsStatistics, decltype(&natsStatistics_Destroy)> statsPtr(stats, &natsStatistics_Destroy);
+
+    uint64_t inMsgs = 0, inBytes = 0, outMsgs = 0, outBytes = 0, reconnects = 0;
+    checkError(natsConnection_GetStats(m_conn, stats));
+    checkError(natsStatistics_GetCounts(stats, &inMsgs, &inBytes, &outMsgs, &outBytes, &reconnects));
+    result.inMessages = inMsgs;
+    result.inBytes = inBytes;
+    result.outMessages = outMsgs;
+    result.outBytes = outBytes;
+    result.reconnects = reconnects;
+    result.bufferedBytes = natsConnection_Buffered(m_conn);
+    result.requests = m_requestCount.load(std::memory_order_relaxed);
+    result.failedRequests = m_failedRequestCount.load(std::memory_order_relaxed);
+    return result;
+}
+
+Statistics Client::statistics() const
+{
+    Statistics result = connectionStatistics();
+    // includes subscriptions made by JetStream objects, which are children of Client
+    for (Subscription* sub : findChildren<Subscription*>()) {
+        result.subscriptions += sub->statistics();
+    }
+    return result;
+}
+
+// the delivery rates are measured only between two ticks of the timer
+// it's a timer slot, so it must not throw
+void Client::emitStatistics()
+{
+    if (!m_conn) {
+        return;
+    }
+    Statistics result;
+    try {
+        result = connectionStatistics();
+    }
+    catch (const Exception&) {
+        return;
+    }
+    for (Subscription* sub : findChildren<Subscription*>()) {
+        try {
+            SubscriptionStatistics stats = sub->statistics();
+            sub->measureDeliveryRate(stats);
+            result.subscriptions += stats;
+        }
+        catch (const Exception&) {
+            // e.g. the subscription has been drained or closed by the server; skip it
+        }
+    }
+    emit statisticsUpdated(result);
+}
+
+void Client::setStatisticsInterval(int interval)
+{
+    if (interval <= 0) {
+        delete m_statisticsTimer;
+        m_statisticsTimer = nullptr;
+        return;
+    }
+    if (!m_statisticsTimer) {
+        m_statisticsTimer = new QTimer(this);
+        connect(m_statisticsTimer, &QTimer::timeout, this, &Client::emitStatistics);
+    }
+    m_statisticsTimer->start(interval);
+}
+
+static QByteArray escapeLabelValue(const QByteArray& value)
+{
+    QByteArray result = value;
+    result.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+    return result;
+}
+
+namespace {
+    class PrometheusWriter
+    {
+    public:
+        explicit PrometheusWriter(const QByteArray& prefix) : m_prefix(prefix) {}
+
+        void header(const char* name, const char* type, const char* help)
+        {
+            m_text += "# HELP " + m_prefix + '_' + name + ' ' + help + '\n';
+            m_text += "# TYPE " + m_prefix + '_' + name + ' ' + type + '\n';
+        }
+
+        void value(const char* name, double value)
+        {
+            m_text += m_prefix + '_' + name + ' ' + QByteArray::number(value, 'g', 17) + '\n';
+        }
+
+        // sid keeps the series unique when several subscriptions share a subject
+        void value(const char* name, double value, const SubscriptionStatistics& sub)
+        {
+            m_text += m_prefix + '_' + name + "{subject=\"" + escapeLabelValue(sub.subject) +
+                "\",sid=\"" + QByteArray::number(sub.sid) + "\"} " + QByteArray::number(value, 'g', 17) + '\n';
+        }
+
+        void metric(const char* name, const char* type, const char* help, double v)
+        {
+            header(name, type, help);
+            value(name, v);
+        }
+
+        QByteArray text() const { return m_text; }
+
+    private:
+        const QByteArray m_prefix;
+        QByteArray m_text;
+    };
+}
+
+QByteArray Statistics::toPrometheus(const QByteArray& prefix) const
+{
+    PrometheusWriter w(prefix);
+
+    w.metric("in_messages_total", "counter", "Messages received by the connection.", inMessages);
+    w.metric("in_bytes_total", "counter", "Bytes received by the connection.", inBytes);
+    w.metric("out_messages_total", "counter", "Messages sent by the connection.", outMessages);
+    w.metric("out_bytes_total", "counter", "Bytes sent by the connection.", outBytes);
+    w.metric("reconnects_total", "counter", "Number of reconnections.", reconnects);
+    w.metric("buffered_bytes", "gauge", "Bytes published, but not flushed to the socket yet.", bufferedBytes);
+    w.metric("requests_total", "counter", "Requests sent with request and asyncRequest.", requests);
+    w.metric("failed_requests_total", "counter", "Requests that failed or timed out.", failedRequests);
+
+    if (subscriptions.isEmpty()) {
+        return w.text();
+    }
+
+    // the text format requires all samples of a metric to be grouped together
+    w.header("subscription_pending_messages", "gauge", "Messages waiting to be delivered to the subscription.");
+    for (const SubscriptionStatistics& sub : subscriptions) {
+        w.value("subscription_pending_messages", sub.pendingMessages, sub);
+    }
+    w.header("subscription_pending_bytes", "gauge", "Bytes waiting to be delivered to the subscription.");
+    for (const SubscriptionStatistics& sub : subscriptions) {
+        w.value("subscription_pending_bytes", sub.pendingBytes, sub);
+    }
+    w.header("subscription_delivered_messages_total", "counter", "Messages delivered to the subscription.");
+    for (const SubscriptionStatistics& sub : subscriptions) {
+        w.value("subscription_delivered_messages_total", sub.deliveredMessages, sub);
+    }
+    w.header("subscription_dropped_messages_total", "counter", "Messages dropped because the subscription was a slow consumer.");
+    for (const SubscriptionStatistics& sub : subscriptions) {
+        w.value("subscription_dropped_messages_total", sub.droppedMessages, sub);
+    }
+    w.header("subscription_delivery_rate", "gauge", "Messages per second delivered to the subscription since the previous snapshot.");
+    for (const SubscriptionStatistics& sub : subscriptions) {
+        w.value("subscription_delivery_rate", sub.deliveryRate, sub);
+    }
+    return w.text();
+}
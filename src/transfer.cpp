@@ -0,0 +1,494 @@
+/* Copyright(c) 2022 Petro Kazmirchuk https://github.com/Kazmirchuk
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with the License.You may obtain a copy of the License at http ://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.See the License for the specific language governing permissions and  limitations under the License.
+*/
+
+#include "qtnats.h"
+#include "qtnats_p.h"
+
+#include <limits>
+
+#include <QCryptographicHash>
+#include <QIODevice>
+#include <QQueue>
+#include <QUuid>
+
+using namespace QtNats;
+
+// a transfer is a sequence of messages with these headers; the last chunk has the size and the digest of the whole content
+static const char* const TransferIdHeader = "Qtnats-Transfer-Id";
+static const char* const ChunkHeader = "Qtnats-Transfer-Chunk"; // 0, 1, 2...
+static const char* const SizeHeader = "Qtnats-Transfer-Size";
+static const char* const DigestHeader = "Qtnats-Transfer-Digest"; // SHA-256=<base64url>, like in the NATS object store
+static const char* const ErrorHeader = "Qtnats-Transfer-Error"; // in a reply to a chunk of Client::sendStream
+
+// room for the headers and the protocol line in every chunk
+static const int HeaderRoom = 1024;
+// chunks that have overtaken the next one; more than the sender's window means that something is wrong
+static const int MaxEarlyChunks = 1024;
+// chunks of JetStream::receiveStream pulled and not written yet
+static const int PullWindow = 8;
+// ms; of a pull request of JetStream::receiveStream, like PullConsumeOptions
+static const qint64 PullExpires = 30000;
+static const qint64 PullHeartbeat = 5000;
+
+static QByteArray digestHeader(QCryptographicHash& hash)
+{
+    return "SHA-256=" + hash.result().toBase64(QByteArray::Base64UrlEncoding);
+}
+
+static int chunkSize(const StreamOptions& options, qint64 maxPayload)
+{
+    qint64 limit = maxPayload - HeaderRoom;
+    if (options.chunkSize > limit) {
+        throw Exception(NATS_MAX_PAYLOAD);
+    }
+    if (options.chunkSize > 0) {
+        return options.chunkSize;
+    }
+    return int(qMin<qint64>(limit, std::numeric_limits<int>::max()));
+}
+
+namespace {
+    // holds only one chunk of source in memory
+    class ChunkReader
+    {
+    public:
+        ChunkReader(QIODevice* source, const QByteArray& subject, int chunkSize, qint64 timeout) :
+            m_source(source),
+            m_subject(subject),
+            m_chunkSize(chunkSize),
+            m_timeout(timeout),
+            m_id(QUuid::createUuid().toByteArray(QUuid::WithoutBraces)),
+            m_digest(QCryptographicHash::Sha256)
+        {
+            m_channelFinished = QObject::connect(source, &QIODevice::readChannelFinished, [this]() { m_finished = true; });
+        }
+        ~ChunkReader() { QObject::disconnect(m_channelFinished); }
+
+        // returns false after the last chunk
+        bool next(Message& chunk);
+
+        QByteArray id() const { return m_id; }
+        quint64 index() const { return m_index - 1; } // of the last chunk returned by next()
+        qint64 bytes() const { return m_bytes; }
+
+    private:
+        QIODevice* const m_source;
+        const QByteArray m_subject;
+        const int m_chunkSize;
+        const qint64 m_timeout;
+        const QByteArray m_id;
+        QCryptographicHash m_digest;
+        quint64 m_index = 0;
+        qint64 m_bytes = 0;
+        bool m_done = false;
+        QMetaObject::Connection m_channelFinished;
+        bool m_finished = false; // the read channel of a sequential device
+    };
+}
+
+bool ChunkReader::next(Message& chunk)
+{
+    if (m_done) {
+        return false;
+    }
+    QByteArray data(m_chunkSize, Qt::Uninitialized);
+    int size = 0;
+    bool end = false;
+    while (size < m_chunkSize) {
+        qint64 n = m_source->read(data.data() + size, m_chunkSize - size);
+        if (n < 0) {
+            throw Exception(NATS_IO_ERROR);
+        }
+        size += int(n);
+        if (n > 0) {
+            continue;
+        }
+        // a sequential device, e.g. QProcess, ends when its read channel is finished
+        if (!m_source->isSequential() || m_finished || !m_source->isOpen()) {
+            end = true;
+            break;
+        }
+        QElapsedTimer waited;
+        waited.start();
+        if (m_source->waitForReadyRead(int(m_timeout))) {
+            continue;
+        }
+        // e.g. QProcess returns right away when the process has exited before, while a socket waits for the whole timeout
+        if (m_finished || (m_source->atEnd() && waited.elapsed() < m_timeout)) {
+            end = true;
+            break;
+        }
+        throw Exception(NATS_TIMEOUT);
+    }
+    // a file that ends exactly at a chunk boundary doesn't need an empty last chunk
+    if (!end && !m_source->isSequential() && m_source->atEnd()) {
+        end = true;
+    }
+    data.truncate(size);
+    m_digest.addData(data);
+    m_bytes += size;
+
+    chunk = Message(m_subject, data);
+    chunk.headers().insert(TransferIdHeader, m_id);
+    chunk.headers().insert(ChunkHeader, QByteArray::number(m_index++));
+    if (end) {
+        chunk.headers().insert(SizeHeader, QByteArray::number(m_bytes));
+        chunk.headers().insert(DigestHeader, digestHeader(m_digest));
+        m_done = true;
+    }
+    return true;
+}
+
+// keeps up to window chunks unacknowledged; check() throws if the ack of a chunk reports an error
+template<typename T, typename Send, typename Check>
+static qint64 sendChunks(ChunkReader& reader, int window, Send send, Check check)
+{
+    QQueue<QFuture<T>> inFlight;
+    Message chunk;
+    while (reader.next(chunk)) {
+        if (inFlight.size() >= qMax(1, window)) {
+            check(inFlight.dequeue().result());
+        }
+        inFlight.enqueue(send(chunk));
+    }
+    while (!inFlight.isEmpty()) {
+        check(inFlight.dequeue().result());
+    }
+    return reader.bytes();
+}
+
+qint64 Client::maxPayload() const
+{
+    return natsConnection_GetMaxPayload(m_conn);
+}
+
+qint64 Client::sendStream(const QByteArray& subject, QIODevice* source, const StreamOptions& options)
+{
+    ChunkReader reader(source, subject, chunkSize(options, maxPayload()), options.timeout);
+    return sendChunks<Message>(reader, options.window,
+        [this, &options](const Message& chunk) { return asyncRequest(chunk, options.timeout); },
+        [](const Message& reply) {
+            if (!reply.header(ErrorHeader).isEmpty()) {
+                throw Exception(NATS_ERR);
+            }
+        });
+}
+
+StreamReceiver* Client::receiveStream(const QByteArray& subject, QIODevice* sink)
+{
+    auto receiver = std::unique_ptr<StreamReceiver>(new StreamReceiver(nullptr));
+    receiver->m_client = this;
+    receiver->m_sink = sink;
+    Subscription* sub = subscribe(subject);
+    sub->setParent(receiver.get());
+    // chunks are written in the thread of the receiver
+    connect(sub, &Subscription::received, receiver.get(), &StreamReceiver::receiveChunk);
+    receiver->setParent(this);
+    return receiver.release();
+}
+
+qint64 JetStream::publishStream(const QByteArray& subject, QIODevice* source, const StreamOptions& options)
+{
+    ChunkReader reader(source, subject, chunkSize(options, m_client->maxPayload()), options.timeout);
+    return sendChunks<JsPublishAck>(reader, options.window,
+        [this, &reader, &options](const Message& chunk) {
+            // the server drops a chunk that was published twice
+            JsPublishOptions opts;
+            opts.msgID = reader.id() + '.' + QByteArray::number(reader.index());
+            opts.timeout = options.timeout;
+            return asyncPublishWithAck(chunk, opts);
+        },
+        [](const JsPublishAck&) {});
+}
+
+namespace QtNats {
+    // pulls the chunks of JetStream::receiveStream, PullWindow at a time, and posts them to the thread of the receiver
+    // the next pull request is sent by that thread after it has written the chunks of the previous one,
+    // so that a slow sink holds back the stream instead of queueing it in memory
+    class ChunkPuller : public std::enable_shared_from_this<ChunkPuller>
+    {
+    public:
+        ChunkPuller(StreamReceiver* receiver, std::shared_ptr<AckConnection> ackConnection, const QByteArray& nextSubject, qint64 ackTimeout, bool zeroCopy) :
+            m_receiver(receiver),
+            m_ackConnection(std::move(ackConnection)),
+            m_nextSubject(nextSubject),
+            m_ackTimeout(ackTimeout),
+            m_zeroCopy(zeroCopy)
+        {}
+
+        // called in the thread of the receiver
+        void pull();
+        // called by ~StreamReceiver; the chunks pulled and not acknowledged yet are dropped with the ephemeral consumer
+        void stop() noexcept;
+
+        // called by ChunkRequest in a cnats thread; last is set for the last chunk of the request
+        void received(Message&& chunk, bool last);
+        void ended(natsStatus status, const QString& text);
+
+    private:
+        QMutex m_mutex;
+        StreamReceiver* m_receiver;
+        // the receiver may outlive the Client
+        const std::shared_ptr<AckConnection> m_ackConnection;
+        const QByteArray m_nextSubject;
+        const qint64 m_ackTimeout;
+        const bool m_zeroCopy;
+        QByteArray m_reply; // of the outstanding pull request
+    };
+}
+
+namespace {
+    class ChunkRequest : public PullRequest
+    {
+    public:
+        ChunkRequest(std::shared_ptr<AckConnection> ackConnection, bool zeroCopy, qint64 ackTimeout, std::shared_ptr<ChunkPuller> puller) :
+            PullRequest(std::move(ackConnection), zeroCopy, ackTimeout),
+            m_puller(std::move(puller))
+        {}
+
+    protected:
+        bool received(Message&& msg) override
+        {
+            // received() and ended() may race when the request expires
+            QMutexLocker locker(&m_mutex);
+            if (isFinished()) {
+                return true; // not acknowledged, so the server redelivers it
+            }
+            bool last = ++m_received == PullWindow && tryFinish();
+            m_puller->received(std::move(msg), last);
+            return last;
+        }
+
+        void ended(natsStatus status, const QString& text) override
+        {
+            QMutexLocker locker(&m_mutex);
+            if (tryFinish()) {
+                m_puller->ended(status, text);
+            }
+        }
+
+    private:
+        const std::shared_ptr<ChunkPuller> m_puller;
+        QMutex m_mutex;
+        int m_received = 0;
+    };
+}
+
+void ChunkPuller::pull()
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_receiver) {
+        return;
+    }
+    natsStatus error = NATS_CONNECTION_CLOSED;
+    const Message request(m_nextSubject, PullRequest::body(PullWindow, 0, PullExpires, PullHeartbeat));
+    auto handler = std::make_shared<ChunkRequest>(m_ackConnection, m_zeroCopy, m_ackTimeout, shared_from_this());
+    m_ackConnection->tryInvoke([&](natsConnection* conn, ResponseMux* mux) {
+        m_reply = mux->add(handler, PullExpires + 2 * PullHeartbeat, 2 * PullHeartbeat);
+        try {
+            publishMessage(conn, request, m_reply.constData());
+            error = NATS_OK;
+        }
+        catch (const Exception& e) {
+            mux->remove(m_reply);
+            error = e.errorCode;
+        }
+    });
+    if (error == NATS_OK) {
+        return;
+    }
+    StreamReceiver* receiver = m_receiver;
+    locker.unlock();
+    receiver->reset();
+    emit receiver->errorOccurred(error, QString::fromLatin1(natsStatus_GetText(error)));
+}
+
+void ChunkPuller::stop() noexcept
+{
+    QMutexLocker locker(&m_mutex);
+    m_receiver = nullptr;
+    if (m_reply.isEmpty()) {
+        return;
+    }
+    // after Client::close(), its ResponseMux has failed the request already
+    m_ackConnection->tryInvoke([this](natsConnection*, ResponseMux* mux) {
+        mux->remove(m_reply);
+    });
+}
+
+void ChunkPuller::received(Message&& chunk, bool last)
+{
+    // the receiver can't be destroyed while a lambda is posted to it
+    QMutexLocker locker(&m_mutex);
+    StreamReceiver* receiver = m_receiver;
+    if (!receiver) {
+        return;
+    }
+    QMetaObject::invokeMethod(receiver, [receiver, chunk = std::move(chunk), last]() mutable {
+        receiver->receiveChunk(chunk);
+        try {
+            chunk.ackNoWait();
+        }
+        catch (const Exception&) {
+            // redelivered after AckWait, and then ignored as a duplicate
+        }
+        if (last) {
+            receiver->m_puller->pull();
+        }
+    }, Qt::QueuedConnection);
+}
+
+void ChunkPuller::ended(natsStatus status, const QString& text)
+{
+    QMutexLocker locker(&m_mutex);
+    StreamReceiver* receiver = m_receiver;
+    if (!receiver) {
+        return;
+    }
+    // after the chunks of this request
+    QMetaObject::invokeMethod(receiver, [receiver, status, text]() {
+        // NATS_TIMEOUT means missed heartbeats: the server may have lost the request
+        if (status == NATS_OK || status == NATS_TIMEOUT) {
+            receiver->m_puller->pull();
+            return;
+        }
+        // e.g. the consumer was deleted or the Client is closed
+        receiver->reset();
+        emit receiver->errorOccurred(status, text);
+    }, Qt::QueuedConnection);
+}
+
+StreamReceiver* JetStream::receiveStream(const QByteArray& stream, const QByteArray& subject, QIODevice* sink, quint64 startSequence)
+{
+    // the server removes the ephemeral consumer after the receiver has stopped pulling
+    jsConsumerConfig cfg;
+    jsConsumerConfig_Init(&cfg);
+    cfg.AckPolicy = js_AckExplicit;
+    cfg.FilterSubject = subject.constData();
+    if (startSequence > 1) {
+        cfg.DeliverPolicy = js_DeliverByStartSequence;
+        cfg.OptStartSeq = startSequence;
+    }
+    jsConsumerInfo* info = nullptr;
+    jsErrCode jsErr = jsErrCode(0);
+    natsStatus s = js_AddConsumer(&info, m_jsCtx, stream.constData(), &cfg, nullptr, &jsErr);
+    if (s != NATS_OK) {
+        throw JetStreamException(s, jsErr);
+    }
+    QByteArray nextSubject = m_apiPrefix + ".CONSUMER.MSG.NEXT." + stream + '.' + info->Name;
+    jsConsumerInfo_Destroy(info);
+
+    auto receiver = std::unique_ptr<StreamReceiver>(new StreamReceiver(nullptr));
+    receiver->m_sink = sink;
+    receiver->m_puller = std::make_shared<ChunkPuller>(receiver.get(), m_client->m_ackConnection, nextSubject, m_timeout > 0 ? m_timeout : 5000, m_zeroCopy);
+    receiver->m_puller->pull();
+    receiver->setParent(this);
+    return receiver.release();
+}
+
+StreamReceiver::~StreamReceiver() noexcept
+{
+    if (m_puller) {
+        m_puller->stop();
+    }
+}
+
+void StreamReceiver::receiveChunk(const Message& chunk)
+{
+    QByteArray id = chunk.header(TransferIdHeader);
+    bool ok = false;
+    quint64 index = chunk.header(ChunkHeader).toULongLong(&ok);
+    QByteArray error;
+
+    if (id.isEmpty() || !ok) {
+        error = "not a chunk";
+    }
+    else {
+        if (index == 0 && id != m_transferId) {
+            if (!m_transferId.isEmpty()) {
+                fail(QStringLiteral("the transfer was interrupted by another one"));
+            }
+            reset();
+            m_transferId = id;
+        }
+        if (id != m_transferId) {
+            error = "unknown transfer"; // e.g. the receiver was created in the middle of it
+        }
+        else if (index > m_nextChunk) {
+            if (m_early.size() < MaxEarlyChunks) {
+                m_early.insert(index, chunk);
+            }
+            else {
+                error = "too many chunks out of order";
+                fail(QString::fromLatin1(error));
+            }
+        }
+        else if (index == m_nextChunk) {
+            error = writeChunk(chunk);
+            // the last chunk resets m_transferId
+            while (error.isEmpty() && !m_transferId.isEmpty() && m_early.contains(m_nextChunk)) {
+                error = writeChunk(m_early.take(m_nextChunk));
+            }
+        }
+        // index < m_nextChunk is a duplicate that has been written already
+    }
+
+    if (m_client && !chunk.reply.isEmpty()) {
+        Message reply(chunk.reply, QByteArray());
+        if (!error.isEmpty()) {
+            reply.headers().insert(ErrorHeader, error);
+        }
+        try {
+            m_client->publish(reply);
+        }
+        catch (const Exception&) {
+            // the sender will time out
+        }
+    }
+}
+
+QByteArray StreamReceiver::writeChunk(const Message& chunk)
+{
+    if (m_sink->write(chunk.data) != chunk.data.size()) {
+        QString error = m_sink->errorString();
+        fail(error);
+        return error.toUtf8();
+    }
+    m_digest->addData(chunk.data);
+    m_bytes += chunk.data.size();
+    m_nextChunk++;
+    emit progress(m_bytes);
+
+    QByteArray size = chunk.header(SizeHeader);
+    if (size.isEmpty()) {
+        return QByteArray();
+    }
+    // the last chunk
+    if (size.toLongLong() != m_bytes || chunk.header(DigestHeader) != digestHeader(*m_digest)) {
+        QByteArray error = "the size or the digest doesn't match";
+        fail(QString::fromLatin1(error));
+        return error;
+    }
+    qint64 bytes = m_bytes;
+    reset();
+    emit finished(bytes);
+    return QByteArray();
+}
+
+void StreamReceiver::fail(const QString& text)
+{
+    reset();
+    emit errorOccurred(NATS_ERR, text);
+}
+
+void StreamReceiver::reset()
+{
+    m_transferId.clear();
+    m_nextChunk = 0;
+    m_bytes = 0;
+    m_early.clear();
+    m_digest = std::make_shared<QCryptographicHash>(QCryptographicHash::Sha256);
+}
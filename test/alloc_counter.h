@@ -0,0 +1,75 @@
+/* Copyright(c) 2022 Petro Kazmirchuk https://github.com/Kazmirchuk
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with the License.You may obtain a copy of the License at http ://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.See the License for the specific language governing permissions and  limitations under the License.
+*/
+
+// Counts heap allocations made by the current thread, including the ones inside Qt and cnats.
+// malloc & co. are interposed, so include this header in exactly one source file of a benchmark executable.
+// Counting is supported only with glibc; elsewhere AllocationCounter::isSupported() returns false.
+
+#pragma once
+
+#include <cstdlib>
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#define QTNATS_COUNT_ALLOCATIONS
+#endif
+
+namespace AllocationCounter {
+
+    static thread_local bool enabled = false;
+    static thread_local long long allocations = 0;
+
+    inline bool isSupported()
+    {
+#ifdef QTNATS_COUNT_ALLOCATIONS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // counts allocations made by the calling thread until the object goes out of scope
+    class Scope
+    {
+    public:
+        Scope() { allocations = 0; enabled = true; }
+        ~Scope() { enabled = false; }
+        long long count() const { return allocations; }
+    };
+}
+
+#ifdef QTNATS_COUNT_ALLOCATIONS
+
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+
+    void* malloc(size_t size) noexcept
+    {
+        if (AllocationCounter::enabled) {
+            AllocationCounter::allocations++;
+        }
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t count, size_t size) noexcept
+    {
+        if (AllocationCounter::enabled) {
+            AllocationCounter::allocations++;
+        }
+        return __libc_calloc(count, size);
+    }
+
+    void* realloc(void* ptr, size_t size) noexcept
+    {
+        if (AllocationCounter::enabled) {
+            AllocationCounter::allocations++;
+        }
+        return __libc_realloc(ptr, size);
+    }
+}
+
+#endif
@@ -0,0 +1,140 @@
+/* Copyright(c) 2022 Petro Kazmirchuk https://github.com/Kazmirchuk
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with the License.You may obtain a copy of the License at http ://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.See the License for the specific language governing permissions and  limitations under the License.
+*/
+
+#include <qtnats.h>
+
+#include <iostream>
+
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QProcess>
+#include <QSemaphore>
+
+#include <QtTest>
+
+#include "alloc_counter.h"
+
+using namespace std;
+using namespace QtNats;
+
+class CoreBenchmark : public QObject
+{
+    Q_OBJECT
+
+    QProcess natsServer;
+    Client client;
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void publish();
+    void publishWithHeaders();
+    void publishAllocations();
+    void deliveryLatencySignal();
+    void deliveryLatencyCallback();
+};
+
+void CoreBenchmark::initTestCase()
+{
+    natsServer.start("nats-server", QStringList());
+    natsServer.waitForStarted();
+    QTest::qWait(1000);
+
+    client.connectToServer(QUrl("nats://localhost:4222"));
+}
+
+void CoreBenchmark::cleanupTestCase()
+{
+    client.close();
+    natsServer.close();
+    natsServer.waitForFinished();
+}
+
+void CoreBenchmark::publish()
+{
+    Message msg("bench_subject", QByteArray(128, 'x'));
+    QBENCHMARK {
+        client.publish(msg);
+    }
+}
+
+void CoreBenchmark::publishWithHeaders()
+{
+    Message msg("bench_subject", QByteArray(128, 'x'));
+    msg.headers().insert("hdr1", "val1");
+    QBENCHMARK {
+        client.publish(msg);
+    }
+}
+
+void CoreBenchmark::publishAllocations()
+{
+    if (!AllocationCounter::isSupported()) {
+        QSKIP("allocation counting is not supported on this platform");
+    }
+    const int count = 10000;
+    Message msg("bench_subject", QByteArray(128, 'x'));
+    Message msgWithHeaders = msg;
+    msgWithHeaders.headers().insert("hdr1", "val1");
+
+    client.publish(msg); // warm-up
+    long long allocations = 0;
+    {
+        AllocationCounter::Scope scope;
+        for (int i = 0; i < count; i++) {
+            client.publish(msg);
+        }
+        allocations = scope.count();
+    }
+    cout << "Allocations per publish without headers: " << double(allocations) / count << endl;
+    QCOMPARE(allocations, 0LL);
+
+    {
+        AllocationCounter::Scope scope;
+        for (int i = 0; i < count; i++) {
+            client.publish(msgWithHeaders);
+        }
+        allocations = scope.count();
+    }
+    cout << "Allocations per publish with headers: " << double(allocations) / count << endl;
+}
+
+// round trip publish -> receipt by a slot in the main thread
+void CoreBenchmark::deliveryLatencySignal()
+{
+    auto sub = client.subscribe("bench_latency_signal");
+    QEventLoop loop;
+    connect(sub, &Subscription::received, &loop, &QEventLoop::quit);
+    client.ping();
+
+    Message msg("bench_latency_signal", QByteArray(128, 'x'));
+    QBENCHMARK {
+        client.publish(msg);
+        loop.exec();
+    }
+    delete sub;
+}
+
+// round trip publish -> receipt by a callback in the cnats delivery thread
+void CoreBenchmark::deliveryLatencyCallback()
+{
+    QSemaphore received;
+    auto sub = client.subscribe("bench_latency_callback", [&received](Message&&) {
+        received.release();
+    });
+    client.ping();
+
+    Message msg("bench_latency_callback", QByteArray(128, 'x'));
+    QBENCHMARK {
+        client.publish(msg);
+        received.acquire();
+    }
+    delete sub;
+}
+
+QTEST_GUILESS_MAIN(CoreBenchmark)
+#include "bench_core.moc"
@@ -0,0 +1,81 @@
+/* Copyright(c) 2022 Petro Kazmirchuk https://github.com/Kazmirchuk
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with the License.You may obtain a copy of the License at http ://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.See the License for the specific language governing permissions and  limitations under the License.
+*/
+
+#include <qtnats.h>
+
+#include <QCoreApplication>
+#include <QProcess>
+
+#include <QtTest>
+
+using namespace QtNats;
+
+class JetStreamBenchmark : public QObject
+{
+    Q_OBJECT
+
+    QProcess natsServer;
+    Client client;
+    JetStream* js = nullptr;
+    KeyValue* kv = nullptr;
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void keyValueGet_data();
+    void keyValueGet();
+};
+
+void JetStreamBenchmark::initTestCase()
+{
+    natsServer.start("nats-server", QStringList() << "-js");
+    natsServer.waitForStarted();
+    QTest::qWait(1000);
+
+    client.connectToServer(QUrl("nats://localhost:4222"));
+    js = client.jetStream();
+
+    KeyValueConfig config;
+    config.bucket = "BENCH_KV";
+    config.memoryStorage = true;
+    kv = js->createKeyValue(config);
+    for (int i = 0; i < 100; i++) {
+        kv->put("key" + QByteArray::number(i), QByteArray(128, 'x'));
+    }
+}
+
+void JetStreamBenchmark::cleanupTestCase()
+{
+    delete kv;
+    js->deleteKeyValue("BENCH_KV");
+    client.close();
+    natsServer.close();
+    natsServer.waitForFinished();
+}
+
+void JetStreamBenchmark::keyValueGet_data()
+{
+    QTest::addColumn<bool>("cached");
+    QTest::newRow("round trip") << false;
+    QTest::newRow("cached") << true;
+}
+
+// the cache can't be switched off, so the uncached row goes first
+void JetStreamBenchmark::keyValueGet()
+{
+    QFETCH(bool, cached);
+    if (cached) {
+        kv->enableCache();
+    }
+    const QByteArray key = "key42";
+    QBENCHMARK {
+        kv->get(key);
+    }
+}
+
+QTEST_GUILESS_MAIN(JetStreamBenchmark)
+#include "bench_jetstream.moc"
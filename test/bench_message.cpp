@@ -0,0 +1,217 @@
+/* Copyright(c) 2022 Petro Kazmirchuk https://github.com/Kazmirchuk
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with the License.You may obtain a copy of the License at http ://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.See the License for the specific language governing permissions and  limitations under the License.
+*/
+
+// conversions between Message and cnats structures; doesn't need nats-server
+
+#include <qtnats.h>
+#include <qtnats_p.h>
+
+#include <cstring>
+#include <iostream>
+
+#include <QtTest>
+
+#include "alloc_counter.h"
+
+// the cnats constructor of received messages (msg.h), it copies the payload of MSG/HMSG as it came from the socket
+// unlike natsMsg_Create, the headers remain raw bytes until they are accessed
+extern "C" natsStatus natsMsg_create(natsMsg** newMsg, const char* subject, int subjLen,
+    const char* reply, int replyLen, const char* buf, int bufLen, int hdrLen);
+
+using namespace std;
+using namespace QtNats;
+
+class MessageBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void toNatsMsg_data() { addRows(); }
+    void toNatsMsg();
+    void fromNatsMsg_data() { addRows(true); }
+    void fromNatsMsg();
+    void decodeHeaders_data() { addRows(); }
+    void decodeHeaders();
+    void headerLookup_data() { addRows(); }
+    void headerLookup();
+    void fromJsPubAck();
+
+private:
+    static void addRows(bool zeroCopyColumn = false);
+    static Message makeMessage();
+    struct Wire
+    {
+        QByteArray buffer; // headers followed by the payload
+        int headerLength = 0;
+        natsMsg* parse() const;
+    };
+    static Wire makeWire();
+    template<typename Setup, typename Op>
+    static void reportAllocations(Setup setup, Op op);
+};
+
+void MessageBenchmark::addRows(bool zeroCopyColumn)
+{
+    QTest::addColumn<int>("payloadSize");
+    QTest::addColumn<int>("headerCount");
+    if (zeroCopyColumn) {
+        QTest::addColumn<bool>("zeroCopy");
+    }
+
+    for (int size : { 0, 128, 4096, 65536 }) {
+        for (int headers : { 0, 1, 8 }) {
+            if (zeroCopyColumn) {
+                QTest::addRow("%d bytes, %d headers, copy", size, headers) << size << headers << false;
+                QTest::addRow("%d bytes, %d headers, zero-copy", size, headers) << size << headers << true;
+            }
+            else {
+                QTest::addRow("%d bytes, %d headers", size, headers) << size << headers;
+            }
+        }
+    }
+}
+
+Message MessageBenchmark::makeMessage()
+{
+    QFETCH(int, payloadSize);
+    QFETCH(int, headerCount);
+
+    Message msg("bench.subject", QByteArray(payloadSize, 'x'));
+    for (int i = 0; i < headerCount; i++) {
+        msg.headers().insert("hdr" + QByteArray::number(i), "value" + QByteArray::number(i));
+    }
+    return msg;
+}
+
+// the same message as makeMessage(), but as it's received in an HMSG
+MessageBenchmark::Wire MessageBenchmark::makeWire()
+{
+    QFETCH(int, payloadSize);
+    QFETCH(int, headerCount);
+
+    Wire wire;
+    if (headerCount > 0) {
+        wire.buffer = "NATS/1.0\r\n";
+        for (int i = 0; i < headerCount; i++) {
+            wire.buffer += "hdr" + QByteArray::number(i) + ": value" + QByteArray::number(i) + "\r\n";
+        }
+        wire.buffer += "\r\n";
+        wire.headerLength = wire.buffer.size();
+    }
+    wire.buffer += QByteArray(payloadSize, 'x');
+    return wire;
+}
+
+natsMsg* MessageBenchmark::Wire::parse() const
+{
+    static const QByteArray subject = "bench.subject";
+    natsMsg* msg = nullptr;
+    natsStatus s = natsMsg_create(&msg, subject.constData(), subject.size(), nullptr, 0,
+        buffer.constData(), buffer.size(), headerLength);
+    if (s != NATS_OK) {
+        qFatal("natsMsg_create failed: %s", natsStatus_GetText(s));
+    }
+    return msg;
+}
+
+// setup() runs outside of the counted scope, op() inside
+template<typename Setup, typename Op>
+void MessageBenchmark::reportAllocations(Setup setup, Op op)
+{
+    if (!AllocationCounter::isSupported()) {
+        return;
+    }
+    const int count = 1000;
+    long long allocations = 0;
+    for (int i = 0; i < count; i++) {
+        auto arg = setup();
+        AllocationCounter::Scope scope;
+        op(arg);
+        allocations += scope.count();
+    }
+    cout << QTest::currentTestFunction() << "(" << QTest::currentDataTag() << "): "
+         << double(allocations) / count << " allocations per operation" << endl;
+}
+
+void MessageBenchmark::toNatsMsg()
+{
+    Message msg = makeMessage();
+
+    QBENCHMARK {
+        NatsMsgPtr p = QtNats::toNatsMsg(msg);
+    }
+    reportAllocations([]() { return 0; }, [&msg](int) {
+        NatsMsgPtr p = QtNats::toNatsMsg(msg);
+    });
+}
+
+void MessageBenchmark::fromNatsMsg()
+{
+    QFETCH(bool, zeroCopy);
+    const Wire wire = makeWire();
+
+    // Message takes ownership of natsMsg, so every iteration includes natsMsg_create and natsMsg_Destroy
+    QBENCHMARK {
+        Message m(wire.parse(), zeroCopy);
+    }
+    reportAllocations([&wire]() { return wire.parse(); }, [zeroCopy](natsMsg* cmsg) {
+        Message m(cmsg, zeroCopy);
+        Q_UNUSED(m);
+    });
+}
+
+void MessageBenchmark::decodeHeaders()
+{
+    const Wire wire = makeWire();
+
+    // headers are decoded once per natsMsg, so every iteration needs a fresh one; QBENCHMARK includes natsMsg_create,
+    // compare with fromNatsMsg. The allocations are counted for the decoding alone
+    QBENCHMARK {
+        const Message incoming(wire.parse());
+        incoming.headers();
+    }
+    reportAllocations([&wire]() { return Message(wire.parse()); }, [](const Message& incoming) {
+        incoming.headers();
+    });
+}
+
+void MessageBenchmark::headerLookup()
+{
+    const Wire wire = makeWire();
+    const QByteArray key = "hdr0";
+
+    // the first lookup parses the raw headers in cnats
+    QBENCHMARK {
+        const Message incoming(wire.parse());
+        incoming.header(key);
+    }
+    reportAllocations([&wire]() { return Message(wire.parse()); }, [&key](const Message& incoming) {
+        incoming.header(key);
+    });
+}
+
+static jsPubAck* makeJsPubAck()
+{
+    // allocated the way cnats does, because fromJsPubAck calls jsPubAck_Destroy
+    jsPubAck* ack = static_cast<jsPubAck*>(calloc(1, sizeof(jsPubAck)));
+    ack->Stream = strdup("BENCH_STREAM");
+    ack->Domain = strdup("hub");
+    ack->Sequence = 123456;
+    return ack;
+}
+
+void MessageBenchmark::fromJsPubAck()
+{
+    QBENCHMARK {
+        QtNats::fromJsPubAck(makeJsPubAck());
+    }
+    reportAllocations(&makeJsPubAck, [](jsPubAck* ack) {
+        QtNats::fromJsPubAck(ack);
+    });
+}
+
+QTEST_GUILESS_MAIN(MessageBenchmark)
+#include "bench_message.moc"
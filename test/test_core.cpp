@@ -6,8 +6,10 @@ Unless required by applicable law or agreed to in writing, software distributed
 
 #include <qtnats.h>
 
+#include <atomic>
 #include <iostream>
 
+#include <QBuffer>
 #include <QCoreApplication>
 #include <QMetaEnum>
 #include <QProcess>
@@ -24,6 +26,44 @@ QString enumToString(T value)
     return QMetaEnum::fromType<T>().valueToKey(castValue);
 }
 
+// a sequential source like the output of a process: it ends only after finish()
+class Pipe : public QIODevice
+{
+public:
+    explicit Pipe(const QByteArray& data) : m_data(data) { open(QIODevice::ReadOnly | QIODevice::Unbuffered); }
+
+    bool isSequential() const override { return true; }
+    bool atEnd() const override { return m_finished && m_data.isEmpty(); }
+    qint64 bytesAvailable() const override { return m_data.size(); }
+    // nothing is written to it meanwhile
+    bool waitForReadyRead(int msecs) override
+    {
+        if (!m_finished) {
+            QThread::msleep(msecs);
+        }
+        return false;
+    }
+    void finish()
+    {
+        m_finished = true;
+        emit readChannelFinished();
+    }
+
+protected:
+    qint64 readData(char* data, qint64 maxSize) override
+    {
+        int n = int(qMin<qint64>(maxSize, m_data.size()));
+        memcpy(data, m_data.constData(), size_t(n));
+        m_data.remove(0, n);
+        return n;
+    }
+    qint64 writeData(const char*, qint64) override { return -1; }
+
+private:
+    QByteArray m_data;
+    bool m_finished = false;
+};
+
 class CoreTestCase : public QObject
 {
     Q_OBJECT
@@ -35,8 +75,20 @@ private slots:
     void cleanupTestCase();
 
     void subscribe();
+    void publishBatch();
     void request();
     void asyncRequest();
+    void asyncRequestFailures();
+    void asyncRequestCancel();
+    void requestMany();
+    void serve();
+    void streamTransfer();
+    void zeroCopy();
+    void batchDelivery();
+    void callbackDelivery();
+    void dedicatedThread();
+    void pendingLimits();
+    void statistics();
 };
 
 void CoreTestCase::initTestCase()
@@ -90,6 +142,42 @@ void CoreTestCase::subscribe()
     }
 }
 
+void CoreTestCase::publishBatch()
+{
+    try {
+        Client receiver;
+        receiver.connectToServer(QUrl("nats://localhost:4222"));
+        std::atomic<int> count { 0 };
+        auto sub = receiver.subscribe("test_batch", [&count](Message&&) { count++; });
+        Q_UNUSED(sub);
+        receiver.ping();
+
+        Options opts;
+        opts.servers += QUrl("nats://localhost:4222");
+        opts.flushPolicy = FlushPolicy::Coalesced;
+        Client c;
+        c.connectToServer(opts);
+
+        QList<Message> batch;
+        for (int i = 0; i < 100; i++) {
+            batch += Message("test_batch", QByteArray::number(i));
+        }
+        // doesn't wait for the server: the cnats flusher sends the batch
+        c.publishBatch(batch);
+        QCOMPARE(c.statistics().outMessages, quint64(100));
+        QTRY_COMPARE(count.load(), 100);
+
+        // with a flush timeout, the batch has reached the server before publishBatch returns
+        QVector<Message> range(50, Message("test_batch", "range"));
+        c.publishBatch(range.cbegin(), range.cend(), 2000);
+        QCOMPARE(c.statistics().bufferedBytes, 0);
+        QTRY_COMPARE(count.load(), 150);
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
 void CoreTestCase::request()
 {
     QProcess responder;
@@ -105,6 +193,11 @@ void CoreTestCase::request()
             Message response = c.request(Message("service", "foo"), 1000);
             QCOMPARE(response.data, "bla");
         }
+        LatencyHistogram latency = c.requestLatency();
+        QCOMPARE(latency.count(), 100ULL);
+        QVERIFY(latency.percentile(50) > 0);
+        QVERIFY(latency.percentile(50) <= latency.percentile(99.9));
+        QVERIFY(latency.percentile(99.9) <= latency.max());
     }
     catch (const QException& e) {
         QFAIL(e.what());
@@ -144,5 +237,487 @@ void CoreTestCase::asyncRequest()
     responder.waitForFinished();
 }
 
+void CoreTestCase::asyncRequestFailures()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+
+        // a subscriber that never replies
+        auto sub = c.subscribe("silent_service");
+        c.ping();
+
+        QFuture<Message> noResponders = c.asyncRequest(Message("no_such_service", "bar"), 1000);
+        QFuture<Message> timedOut = c.asyncRequest(Message("silent_service", "bar"), 200);
+        QFuture<Message> pending = c.asyncRequest(Message("silent_service", "bar"), 60000);
+        QTest::qWait(500);
+
+        QCOMPARE(noResponders.isFinished(), true);
+        QCOMPARE(timedOut.isFinished(), true);
+        QCOMPARE(pending.isFinished(), false);
+        try {
+            timedOut.result();
+            QFAIL("the request must time out");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_TIMEOUT);
+        }
+        try {
+            noResponders.result();
+            QFAIL("the request must fail");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_NO_RESPONDERS);
+        }
+
+        // pending requests fail when the connection is closed
+        delete sub;
+        c.close();
+        QCOMPARE(pending.isFinished(), true);
+        try {
+            pending.result();
+            QFAIL("the request must fail");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_CONNECTION_CLOSED);
+        }
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void CoreTestCase::asyncRequestCancel()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+
+        QByteArray replySubject;
+        auto sub = c.subscribe("slow_service", [&replySubject](Message&& m) {
+            replySubject = m.reply;
+        });
+        c.ping();
+
+        QFuture<Message> f = c.asyncRequest(Message("slow_service", "bar"), 60000);
+        QTest::qWait(200);
+        f.cancel();
+        QTest::qWait(200);
+        QCOMPARE(f.isCanceled(), true);
+        QCOMPARE(f.isFinished(), true);
+
+        // a late response is dropped
+        c.publish(Message(replySubject, "late"));
+        c.ping();
+        QCOMPARE(f.resultCount(), 0);
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+        // the continuation runs in the thread that received the response
+        QProcess responder;
+        responder.start("nats", QStringList() << "reply" << "service" << "bla");
+        responder.waitForStarted();
+        QTest::qWait(1000);
+
+        QFuture<QByteArray> data = c.asyncRequest(Message("service", "bar")).then([](const Message& m) {
+            return m.data;
+        });
+        data.waitForFinished();
+        QCOMPARE(data.result(), "bla");
+        responder.close();
+        responder.waitForFinished();
+#endif
+        delete sub;
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void CoreTestCase::requestMany()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+
+        QList<Subscription*> responders;
+        for (int i = 0; i < 3; i++) {
+            responders += c.subscribe("scatter_service", [&c, i](Message&& m) {
+                c.publish(Message(m.reply, QByteArray::number(i)));
+            });
+        }
+        c.ping();
+
+        // completes on count
+        QElapsedTimer timer;
+        timer.start();
+        QFuture<Message> f = c.requestMany(Message("scatter_service", "bar"), 3, 5000);
+        f.waitForFinished();
+        QVERIFY(timer.elapsed() < 1000);
+        QCOMPARE(f.resultCount(), 3);
+
+        // completes on stall, well before the total timeout
+        timer.restart();
+        f = c.requestMany(Message("scatter_service", "bar"), 0, 5000, 200);
+        f.waitForFinished();
+        QVERIFY(timer.elapsed() < 2000);
+        QCOMPARE(f.resultCount(), 3);
+
+        // completes on timeout
+        timer.restart();
+        f = c.requestMany(Message("scatter_service", "bar"), 10, 500);
+        f.waitForFinished();
+        QVERIFY(timer.elapsed() >= 500);
+        QCOMPARE(f.resultCount(), 3);
+
+        qDeleteAll(responders);
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void CoreTestCase::serve()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+
+        std::atomic<int> concurrent { 0 };
+        std::atomic<int> maxConcurrent { 0 };
+        ServiceOptions options;
+        options.workerThreads = 2;
+        auto endpoint = c.serve("upper_service", "workers", [&concurrent, &maxConcurrent](const Message& request) {
+            int current = ++concurrent;
+            int seen = maxConcurrent;
+            while (current > seen && !maxConcurrent.compare_exchange_weak(seen, current)) {}
+            QThread::msleep(100);
+            concurrent--;
+            if (request.data == "fail") {
+                throw std::runtime_error("bad request");
+            }
+            return Message(QByteArray(), request.data.toUpper());
+        }, options);
+        c.ping();
+
+        QList<QFuture<Message>> futures;
+        for (int i = 0; i < 6; i++) {
+            futures += c.asyncRequest(Message("upper_service", "foo"), 5000);
+        }
+        QFuture<Message> failed = c.asyncRequest(Message("upper_service", "fail"), 5000);
+        for (QFuture<Message> f : futures) {
+            QCOMPARE(f.result().data, "FOO");
+        }
+        QCOMPARE(failed.result().header("Nats-Service-Error"), "bad request");
+        QCOMPARE(maxConcurrent.load(), 2);
+
+        QTest::qWait(100); // a worker frees its slot after publishing the reply
+        ServiceStatistics stats = endpoint->statistics();
+        QCOMPARE(stats.requests, 7ULL);
+        QCOMPARE(stats.errors, 1ULL);
+        QCOMPARE(stats.inFlight, 0);
+        QCOMPARE(stats.processingTime.count(), 7ULL);
+        QVERIFY(stats.processingTime.percentile(50) >= 100 * 1000 * 1000);
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void CoreTestCase::streamTransfer()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+        QVERIFY(c.maxPayload() > 0);
+
+        QByteArray content;
+        for (int i = 0; i < 300000; i++) {
+            content += QByteArray::number(i);
+        }
+        QBuffer source(&content);
+        source.open(QIODevice::ReadOnly);
+        QBuffer sink;
+        sink.open(QIODevice::WriteOnly);
+
+        auto receiver = c.receiveStream("transfer", &sink);
+        qint64 received = -1;
+        int errors = 0;
+        connect(receiver, &StreamReceiver::finished, [&received](qint64 size) { received = size; });
+        connect(receiver, &StreamReceiver::errorOccurred, [&errors]() { errors++; });
+
+        // sendStream blocks, while the receiver needs this thread's event loop
+        StreamOptions options;
+        options.chunkSize = 64 * 1024;
+        options.window = 4;
+        std::atomic<qint64> sent { -1 };
+        QThread* sender = QThread::create([&c, &source, &options, &sent]() {
+            sent = c.sendStream("transfer", &source, options);
+        });
+        sender->start();
+        QTRY_COMPARE(received, qint64(content.size()));
+        sender->wait();
+        delete sender;
+        QCOMPARE(sent.load(), qint64(content.size()));
+        QCOMPARE(errors, 0);
+        QVERIFY(sink.data() == content);
+
+        // a sequential source ends when its read channel is finished
+        sink.buffer().clear();
+        sink.seek(0);
+        received = -1;
+        Pipe pipe(content);
+        pipe.finish();
+        sender = QThread::create([&c, &pipe, &options, &sent]() {
+            sent = c.sendStream("transfer", &pipe, options);
+        });
+        sender->start();
+        QTRY_COMPARE(received, qint64(content.size()));
+        sender->wait();
+        delete sender;
+        QCOMPARE(sent.load(), qint64(content.size()));
+        QVERIFY(sink.data() == content);
+
+        // and doesn't end silently when no data comes within the timeout
+        Pipe stalled(content.left(1000));
+        options.timeout = 200;
+        try {
+            c.sendStream("transfer", &stalled, options);
+            QFAIL("the source has stalled");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_TIMEOUT);
+        }
+        QCOMPARE(received, qint64(content.size())); // the incomplete transfer isn't finished
+        options.timeout = 5000;
+
+        // a chunk can't be larger than max payload
+        options.chunkSize = int(c.maxPayload());
+        try {
+            c.sendStream("transfer", &source, options);
+            QFAIL("the chunk size is too large");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_MAX_PAYLOAD);
+        }
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void CoreTestCase::zeroCopy()
+{
+    try {
+        Options opts;
+        opts.servers += QUrl("nats://localhost:4222");
+        opts.zeroCopyMessages = true;
+
+        Client c;
+        c.connectToServer(opts);
+        auto sub = c.subscribe("test_zero_copy");
+
+        QList<Message> msgList;
+        connect(sub, &Subscription::received, [&msgList](const Message& message) {
+            msgList += message;
+        });
+
+        c.ping();
+        c.publish(Message("test_zero_copy", "hello"));
+        QTest::qWait(500);
+
+        QCOMPARE(msgList.size(), 1);
+        Message m = msgList.takeFirst();
+        QCOMPARE(m.subject, "test_zero_copy");
+        QCOMPARE(m.data, "hello");
+        // writing detaches the view from the cnats buffer
+        m.data.append(" world");
+        QCOMPARE(m.data, "hello world");
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void CoreTestCase::batchDelivery()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+        auto sub = c.subscribe("test_batch");
+        sub->setBatchDelivery(10, 100);
+
+        int batchCount = 0;
+        QList<Message> msgList;
+        connect(sub, &Subscription::received, [](const Message&) {
+            QFAIL("received must not be emitted in the batch mode");
+        });
+        connect(sub, &Subscription::receivedBatch, [&msgList, &batchCount](const QVector<Message>& messages) {
+            QVERIFY(messages.size() <= 10);
+            batchCount++;
+            for (const Message& m : messages) {
+                msgList += m;
+            }
+        });
+
+        c.ping();
+        for (int i = 0; i < 95; i++) {
+            c.publish(Message("test_batch", QByteArray::number(i)));
+        }
+        QTest::qWait(1000);
+
+        QCOMPARE(msgList.size(), 95);
+        QVERIFY(batchCount >= 10);
+        for (int i = 0; i < msgList.size(); i++) {
+            QCOMPARE(msgList[i].data, QByteArray::number(i));
+        }
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void CoreTestCase::callbackDelivery()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+
+        QSemaphore received;
+        QByteArray payload;
+        auto sub = c.subscribe("test_callback", [&received, &payload](Message&& m) {
+            payload = std::move(m.data);
+            received.release();
+        });
+        Q_UNUSED(sub);
+
+        c.ping();
+        c.publish(Message("test_callback", "hello"));
+
+        QVERIFY(received.tryAcquire(1, 1000));
+        QCOMPARE(payload, "hello");
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void CoreTestCase::dedicatedThread()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+
+        SubscribeOptions opts;
+        opts.dedicatedThread = true;
+        opts.cpuAffinity = 0;
+        auto sub = c.subscribe("test_dedicated", opts);
+
+        QList<Message> msgList;
+        connect(sub, &Subscription::received, [&msgList](const Message& message) {
+            msgList += message;
+        });
+
+        c.ping();
+        for (int i = 0; i < 10; i++) {
+            c.publish(Message("test_dedicated", "hello"));
+        }
+        QTest::qWait(500);
+
+        QCOMPARE(msgList.size(), 10);
+        delete sub; // must stop the delivery thread
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void CoreTestCase::pendingLimits()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+
+        std::atomic<bool> first { true };
+        auto sub = c.subscribe("test_slow", [&first](Message&&) {
+            if (first.exchange(false)) {
+                QThread::msleep(1000); // let the backlog build up
+            }
+        });
+        sub->setPendingLimits(10, -1);
+
+        int slowConsumerCount = 0;
+        connect(sub, &Subscription::slowConsumer, [&slowConsumerCount]() {
+            slowConsumerCount++;
+        });
+
+        c.ping();
+        for (int i = 0; i < 100; i++) {
+            c.publish(Message("test_slow", "hello"));
+        }
+        QTest::qWait(2000);
+
+        SubscriptionStatistics stats = sub->statistics();
+        QCOMPARE(stats.pendingMessagesLimit, 10);
+        QVERIFY(stats.droppedMessages > 0);
+        QCOMPARE(stats.deliveredMessages + stats.droppedMessages, 100LL);
+        QVERIFY(slowConsumerCount > 0);
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void CoreTestCase::statistics()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+        auto sub = c.subscribe("test_stats");
+        Q_UNUSED(sub);
+
+        QList<Statistics> updates;
+        connect(&c, &Client::statisticsUpdated, [&updates](const Statistics& stats) {
+            updates += stats;
+        });
+        c.setStatisticsInterval(100);
+        // the first update is the baseline of the delivery rate
+        QTRY_VERIFY(!updates.isEmpty());
+
+        c.ping();
+        for (int i = 0; i < 10; i++) {
+            c.publish(Message("test_stats", "hello"));
+            // doesn't disturb the rate reported by statisticsUpdated
+            QCOMPARE(c.statistics().subscriptions[0].deliveryRate, 0.0);
+        }
+        QTest::qWait(500);
+        c.setStatisticsInterval(0);
+
+        bool rateReported = false;
+        for (const Statistics& update : qAsConst(updates)) {
+            if (update.subscriptions.size() == 1 && update.subscriptions[0].deliveryRate > 0) {
+                rateReported = true;
+            }
+        }
+        QVERIFY(rateReported);
+
+        Statistics stats = c.statistics();
+        QCOMPARE(stats.outMessages, 10ULL);
+        QCOMPARE(stats.inMessages, 10ULL);
+        QCOMPARE(stats.subscriptions.size(), 1);
+        QCOMPARE(stats.subscriptions[0].subject, "test_stats");
+        QCOMPARE(stats.subscriptions[0].deliveredMessages, 10LL);
+        QVERIFY(updates.size() >= 3);
+
+        QByteArray text = stats.toPrometheus();
+        QVERIFY(text.contains("# TYPE nats_out_messages_total counter\nnats_out_messages_total 10\n"));
+        QVERIFY(stats.subscriptions[0].sid > 0);
+        QVERIFY(text.contains("nats_subscription_delivered_messages_total{subject=\"test_stats\",sid=\"" +
+            QByteArray::number(stats.subscriptions[0].sid) + "\"} 10\n"));
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
 QTEST_GUILESS_MAIN(CoreTestCase)
 #include "test_core.moc"
@@ -8,6 +8,7 @@ Unless required by applicable law or agreed to in writing, software distributed
 
 #include <iostream>
 
+#include <QBuffer>
 #include <QCoreApplication>
 #include <QMetaEnum>
 #include <QDir>
@@ -25,6 +26,19 @@ QString enumToString(T value)
     return QMetaEnum::fromType<T>().valueToKey(castValue);
 }
 
+// messages delivered and not acknowledged yet
+static int ackPending(JetStream* js, const char* consumer)
+{
+    jsConsumerInfo* info = nullptr;
+    jsErrCode jsErr;
+    if (js_GetConsumerInfo(&info, js->getJsContext(), "MY_STREAM", consumer, nullptr, &jsErr) != NATS_OK) {
+        return -1;
+    }
+    int result = int(info->NumAckPending);
+    jsConsumerInfo_Destroy(info);
+    return result;
+}
+
 class JetStreamTestCase : public QObject
 {
     Q_OBJECT
@@ -37,7 +51,16 @@ private slots:
     void cleanupTestCase();
 
     void publish();
+    void asyncPublishWithAck();
+    void asyncPublishWindow();
+    void asyncPublishRetry();
     void pullSubscribe();
+    void pullFetchAsync();
+    void pullConsume();
+    void asyncAck();
+    void orderedReader();
+    void keyValue();
+    void streamTransfer();
     void pushSubscribe();
 };
 
@@ -90,6 +113,164 @@ void JetStreamTestCase::publish()
     }
 }
 
+void JetStreamTestCase::asyncPublishWithAck()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+        auto js = c.jetStream();
+
+        // headers are kept by asyncPublish
+        Message withHeader("test.async_hdr", "HI");
+        withHeader.headers().insert("hdr1", "val1");
+        js->asyncPublish(withHeader);
+        js->waitForPublishCompleted();
+        auto sub = js->subscribe("test.async_hdr", "MY_STREAM", QByteArray());
+        QSignalSpy spy(sub, &Subscription::received);
+        QVERIFY(spy.wait());
+        QCOMPARE(spy.at(0).at(0).value<Message>().header("hdr1"), "val1");
+        delete sub;
+
+        QList<QFuture<JsPublishAck>> futures;
+        for (int i = 0; i < 10; i++) {
+            futures += js->asyncPublishWithAck(Message("test.async_ack", QByteArray::number(i)));
+        }
+        quint64 previous = 0;
+        for (QFuture<JsPublishAck> f : futures) {
+            JsPublishAck ack = f.result();
+            QCOMPARE(ack.stream, "MY_STREAM");
+            QVERIFY(ack.sequence > previous);
+            previous = ack.sequence;
+        }
+
+        // a duplicate is detected by Nats-Msg-Id
+        JsPublishOptions opts;
+        opts.msgID = "unique_id";
+        QCOMPARE(js->asyncPublishWithAck(Message("test.async_ack", "dup"), opts).result().duplicate, false);
+        QCOMPARE(js->asyncPublishWithAck(Message("test.async_ack", "dup"), opts).result().duplicate, true);
+
+        // the server rejects a wrong expected stream
+        opts = JsPublishOptions();
+        opts.expectStream = "OTHER_STREAM";
+        try {
+            js->asyncPublishWithAck(Message("test.async_ack", "bla"), opts).result();
+            QFAIL("the message must be rejected");
+        }
+        catch (const JetStreamException& e) {
+            QVERIFY(e.jsError != 0);
+        }
+
+        // no stream for this subject
+        try {
+            js->asyncPublishWithAck(Message("no_stream", "bla")).result();
+            QFAIL("the message must be rejected");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_NO_RESPONDERS);
+        }
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void JetStreamTestCase::asyncPublishWindow()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+        JsOptions options;
+        options.maxPendingAsync = 10;
+        options.stallWait = 2000;
+        auto js = c.jetStream(options);
+
+        std::atomic<int> full { 0 };
+        std::atomic<int> drained { 0 };
+        connect(js, &JetStream::publishWindowFull, [&full]() { full++; });
+        connect(js, &JetStream::publishWindowDrained, [&drained]() { drained++; });
+
+        for (int i = 0; i < 100; i++) {
+            js->asyncPublish(Message("test.window", "HI"));
+        }
+        QFuture<void> completed = js->publishCompleted();
+        completed.waitForFinished();
+        QCOMPARE(completed.isFinished(), true);
+        QVERIFY(full > 0);
+        QVERIFY(drained > 0);
+
+        // nothing is pending
+        QCOMPARE(js->publishCompleted().isFinished(), true);
+        js->waitForPublishCompleted(0);
+
+        options.maxPendingAsync = 0;
+        try {
+            c.jetStream(options);
+            QFAIL("the publish window can't be empty");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_INVALID_ARG);
+        }
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void JetStreamTestCase::asyncPublishRetry()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+        JsOptions options;
+        options.retry.maxAttempts = 3;
+        options.retry.initialBackoff = 100;
+        auto js = c.jetStream(options);
+
+        QCOMPARE(js->asyncPublishWithAck(Message("test.retry", "HI")).result().stream, "MY_STREAM");
+
+        // no stream for this subject: the message is published 3 times with backoff 100 and 200 ms
+        QElapsedTimer timer;
+        timer.start();
+        try {
+            js->asyncPublishWithAck(Message("no_stream", "bla")).result();
+            QFAIL("the message must be rejected");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_NO_RESPONDERS);
+        }
+        QVERIFY(timer.elapsed() >= 300);
+
+        // a rejection by the server is not retried
+        JsPublishOptions opts;
+        opts.expectStream = "OTHER_STREAM";
+        timer.restart();
+        try {
+            js->asyncPublishWithAck(Message("test.retry", "bla"), opts).result();
+            QFAIL("the message must be rejected");
+        }
+        catch (const JetStreamException& e) {
+            QVERIFY(e.jsError != 0);
+        }
+        QVERIFY(timer.elapsed() < 100);
+
+        // the JetStream doesn't wait for a message that is being retried, which still fails later
+        QFuture<JsPublishAck> pending = js->asyncPublishWithAck(Message("no_stream", "bla"));
+        timer.restart();
+        delete js;
+        QVERIFY(timer.elapsed() < 100);
+        try {
+            pending.waitForFinished();
+            QFAIL("the message must be rejected");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_NO_RESPONDERS);
+        }
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
 void JetStreamTestCase::pullSubscribe() {
     try {
         Client c;
@@ -115,7 +296,8 @@ void JetStreamTestCase::pullSubscribe() {
         for (Message m : msgList) {
             QCOMPARE(m.data, "hello JS");
             QCOMPARE(m.subject, "test.pull");
-            auto val = m.headers.values("hdr1");
+            QCOMPARE(m.header("hdr1"), "val1");
+            auto val = m.headers().values("hdr1");
             QCOMPARE(val.size(), 1);
             QCOMPARE(val[0], "val1");
         }
@@ -125,6 +307,384 @@ void JetStreamTestCase::pullSubscribe() {
     }
 }
 
+void JetStreamTestCase::pullFetchAsync()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+
+        auto js = c.jetStream();
+        // pullSubscribe has consumed all messages of PULL_CONSUMER
+        auto sub = js->pullSubscribe("test.pull", "MY_STREAM", "PULL_CONSUMER");
+
+        natsCli.start("nats", QStringList() << "publish" << "--count=5" << "test.pull" << "hello async");
+        natsCli.waitForFinished();
+
+        // fewer messages than requested: the future finishes after the timeout
+        QFuture<QList<Message>> f = sub->fetchAsync(10, 0, 1000);
+        QCOMPARE(f.isFinished(), false);
+        QList<Message> msgList = f.result();
+        QCOMPARE(msgList.size(), 5);
+        for (Message m : msgList) {
+            QCOMPARE(m.data, "hello async");
+            m.ack();
+        }
+
+        try {
+            sub->fetchAsync(1, 0, 500).result();
+            QFAIL("there must be no messages");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_TIMEOUT);
+        }
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void JetStreamTestCase::pullConsume()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+
+        auto js = c.jetStream();
+
+        natsCli.start("nats", QStringList() << "consumer" << "add" << "MY_STREAM" << "CONSUME_CONSUMER" << "--config=consume_consumer_config.json");
+        natsCli.waitForFinished();
+
+        natsCli.start("nats", QStringList() << "publish" << "--count=100" << "test.consume" << "hello consumer");
+        natsCli.waitForFinished();
+
+        auto sub = js->pullSubscribe("test.consume", "MY_STREAM", "CONSUME_CONSUMER");
+
+        PullConsumeOptions opts;
+        opts.batch = 10;
+        opts.prefetch = 3;
+        opts.expires = 2000;
+        opts.idleHeartbeat = 500;
+        std::atomic<int> count { 0 };
+        sub->consume([&count](Message&& m) {
+            if (m.data == "hello consumer") {
+                count++;
+            }
+            // ack() would block the thread that delivers all messages of the Client
+            m.ackNoWait();
+        }, opts);
+        QTRY_COMPARE(count.load(), 100);
+
+        // the consumer keeps pulling after running out of messages
+        natsCli.start("nats", QStringList() << "publish" << "--count=5" << "test.consume" << "hello consumer");
+        natsCli.waitForFinished();
+        QTRY_COMPARE(count.load(), 105);
+
+        sub->stopConsuming();
+        natsCli.start("nats", QStringList() << "publish" << "test.consume" << "hello consumer");
+        natsCli.waitForFinished();
+        QTest::qWait(500);
+        QCOMPARE(count.load(), 105);
+
+        // the message published after stopping is still there
+        auto msgList = sub->fetch(1);
+        QCOMPARE(msgList.size(), 1);
+        msgList[0].ack();
+
+        // closing the Client stops consuming, and it is reported once
+        sub->consume(opts);
+        QList<natsStatus> errors;
+        connect(sub, &PullSubscription::errorOccurred, this, [&errors](natsStatus error) { errors += error; });
+        c.close();
+        QCOMPARE(errors, QList<natsStatus>() << NATS_CONNECTION_CLOSED);
+
+        // the subscription doesn't touch the closed Client anymore
+        sub->stopConsuming();
+        try {
+            sub->fetchAsync();
+            QFAIL("the Client is closed");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_CONNECTION_CLOSED);
+        }
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void JetStreamTestCase::asyncAck()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+
+        auto js = c.jetStream();
+        auto sub = js->pullSubscribe("test.pull", "MY_STREAM", "PULL_CONSUMER");
+
+        natsCli.start("nats", QStringList() << "publish" << "--count=30" << "test.pull" << "hello ack");
+        natsCli.waitForFinished();
+
+        // acknowledged by qtnats
+        QList<Message> msgList = sub->fetchAsync(10).result();
+        QCOMPARE(msgList.size(), 10);
+        QList<QFuture<void>> futures;
+        for (Message m : msgList) {
+            futures += m.ackAsync();
+        }
+        for (QFuture<void> f : futures) {
+            f.waitForFinished(); // throws if the ack has failed
+        }
+
+        // acknowledged by cnats
+        msgList = sub->fetch(10);
+        QCOMPARE(msgList.size(), 10);
+        try {
+            msgList[0].ackAsync();
+            QFAIL("ackAsync works only for pulled messages");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_ILLEGAL_STATE);
+        }
+        for (Message m : msgList) {
+            m.ackNoWait();
+        }
+
+        AckBatchOptions opts;
+        opts.maxBatch = 4;
+        opts.maxDelay = 50;
+        auto batcher = js->ackBatcher(opts);
+        std::atomic<int> errors { 0 };
+        connect(batcher, &AckBatcher::errorOccurred, this, [&errors]() { errors++; });
+        msgList = sub->fetchAsync(10).result();
+        QCOMPARE(msgList.size(), 10);
+        for (const Message& m : msgList) {
+            batcher->ack(m);
+        }
+        // the last 2 acks are sent by the timer
+        QTRY_COMPARE(ackPending(js, "PULL_CONSUMER"), 0);
+        QCOMPARE(errors.load(), 0);
+
+        // only the last message of the batch is acknowledged, which acknowledges the others on an AckPolicy all consumer
+        natsCli.start("nats", QStringList() << "consumer" << "add" << "MY_STREAM" << "ACK_ALL_CONSUMER" << "--config=ack_all_consumer_config.json");
+        natsCli.waitForFinished();
+        natsCli.start("nats", QStringList() << "publish" << "--count=10" << "test.ack_all" << "hello ack all");
+        natsCli.waitForFinished();
+        auto ackAllSub = js->pullSubscribe("test.ack_all", "MY_STREAM", "ACK_ALL_CONSUMER");
+        opts.maxBatch = 10;
+        opts.maxDelay = 0;
+        opts.ackAll = true;
+        auto ackAllBatcher = js->ackBatcher(opts);
+        connect(ackAllBatcher, &AckBatcher::errorOccurred, this, [&errors]() { errors++; });
+        msgList = ackAllSub->fetchAsync(10).result();
+        QCOMPARE(msgList.size(), 10);
+        QCOMPARE(ackPending(js, "ACK_ALL_CONSUMER"), 10);
+        for (const Message& m : msgList) {
+            ackAllBatcher->ack(m);
+        }
+        QTRY_COMPARE(ackPending(js, "ACK_ALL_CONSUMER"), 0);
+        QCOMPARE(errors.load(), 0);
+
+        // a pulled message may outlive its Client
+        natsCli.start("nats", QStringList() << "publish" << "test.pull" << "hello ack");
+        natsCli.waitForFinished();
+        msgList = sub->fetchAsync(1).result();
+        QCOMPARE(msgList.size(), 1);
+        c.close();
+        try {
+            msgList[0].ackNoWait();
+            QFAIL("the Client is closed");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_CONNECTION_CLOSED);
+        }
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void JetStreamTestCase::orderedReader()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+        auto js = c.jetStream();
+
+        QDateTime start = QDateTime::currentDateTimeUtc();
+        QList<quint64> sequences;
+        for (int i = 0; i < 20; i++) {
+            sequences += js->publish(Message("test.ordered", QByteArray::number(i))).sequence;
+        }
+
+        QList<QByteArray> fromSequence;
+        QMutex mutex;
+        auto sub = js->orderedReader("MY_STREAM", sequences[10], "test.ordered", [&fromSequence, &mutex](Message&& m) {
+            QMutexLocker locker(&mutex);
+            fromSequence += m.data;
+        });
+        QList<QByteArray> fromTime;
+        auto sub2 = js->orderedReader("MY_STREAM", start, "test.ordered");
+        connect(sub2, &Subscription::received, [&fromTime](const Message& m) {
+            fromTime += m.data;
+        });
+
+        QTRY_COMPARE(fromTime.size(), 20);
+        for (int i = 0; i < 20; i++) {
+            QCOMPARE(fromTime[i], QByteArray::number(i));
+        }
+        QMutexLocker locker(&mutex);
+        QCOMPARE(fromSequence.size(), 10);
+        for (int i = 0; i < 10; i++) {
+            QCOMPARE(fromSequence[i], QByteArray::number(i + 10));
+        }
+        locker.unlock();
+        delete sub;
+        delete sub2;
+
+        // MY_STREAM has the subject test.*, so the filter can't be omitted
+        try {
+            js->orderedReader("MY_STREAM", 1);
+            QFAIL("a filter subject is required");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_INVALID_ARG);
+        }
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void JetStreamTestCase::keyValue()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+        auto js = c.jetStream();
+
+        KeyValueConfig config;
+        config.bucket = "TEST_KV";
+        config.history = 5;
+        config.memoryStorage = true;
+        auto kv = js->createKeyValue(config);
+
+        quint64 rev1 = kv->put("key1", "value1");
+        QCOMPARE(kv->get("key1").value, "value1");
+        quint64 rev2 = kv->update("key1", "value2", rev1);
+        QVERIFY(rev2 > rev1);
+        try {
+            kv->update("key1", "value3", rev1);
+            QFAIL("the revision is outdated");
+        }
+        catch (const Exception&) {}
+        try {
+            kv->create("key1", "value3");
+            QFAIL("the key exists");
+        }
+        catch (const Exception&) {}
+        kv->create("key2", "bla");
+
+        QList<QByteArray> keys = kv->keys();
+        std::sort(keys.begin(), keys.end());
+        QCOMPARE(keys, QList<QByteArray>() << "key1" << "key2");
+        QList<KeyValueEntry> history = kv->history("key1");
+        QCOMPARE(history.size(), 2);
+        QCOMPARE(history[0].value, "value1");
+        QCOMPARE(history[1].value, "value2");
+        QCOMPARE(kv->get("key1", rev1).value, "value1");
+
+        // the signals are emitted from the thread of the watcher and queued to this one
+        QList<KeyValueEntry> updates;
+        bool initialDone = false;
+        auto watcher = kv->watch("key*");
+        connect(watcher, &KeyValueWatcher::updated, this, [&updates](const KeyValueEntry& e) { updates += e; });
+        connect(watcher, &KeyValueWatcher::initialValuesReceived, this, [&initialDone]() { initialDone = true; });
+        QTRY_VERIFY(initialDone);
+        QCOMPARE(updates.size(), 2);
+
+        kv->remove("key2");
+        QTRY_COMPARE(updates.size(), 3);
+        QCOMPARE(updates[2].operation, KeyValueOperation::Delete);
+        try {
+            kv->get("key2");
+            QFAIL("the key is deleted");
+        }
+        catch (const Exception& e) {
+            QCOMPARE(e.errorCode, NATS_NOT_FOUND);
+        }
+
+        // the cache is updated by this KeyValue as well as by other clients
+        kv->enableCache();
+        QCOMPARE(kv->get("key1").value, "value2");
+        kv->put("key1", "value3");
+        QCOMPARE(kv->get("key1").value, "value3");
+        // get throws NATS_NOT_FOUND until the watcher has delivered the key
+        auto cachedValueIs = [kv](const QByteArray& key, const QByteArray& value) {
+            try {
+                return kv->get(key).value == value;
+            }
+            catch (const Exception& e) {
+                return e.errorCode == NATS_NOT_FOUND && value.isNull();
+            }
+        };
+        auto other = js->keyValue("TEST_KV");
+        other->put("key3", "from other");
+        QTRY_VERIFY(cachedValueIs("key3", "from other"));
+        other->remove("key1");
+        QTRY_VERIFY(cachedValueIs("key1", QByteArray()));
+
+        // deletions by this KeyValue are visible right away, and the watcher can't bring the key back
+        other->put("key4", "value4");
+        QTRY_VERIFY(cachedValueIs("key4", "value4"));
+        kv->remove("key4");
+        QVERIFY(cachedValueIs("key4", QByteArray()));
+        other->put("key5", "value5");
+        kv->purge("key3");
+        QVERIFY(cachedValueIs("key3", QByteArray()));
+        QTRY_VERIFY(cachedValueIs("key5", "value5"));
+        QVERIFY(cachedValueIs("key4", QByteArray()));
+        QVERIFY(cachedValueIs("key3", QByteArray()));
+        QCOMPARE(kv->history("key3").size(), 1); // only the purge marker is left
+
+        delete kv;
+        js->deleteKeyValue("TEST_KV");
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
+void JetStreamTestCase::streamTransfer()
+{
+    try {
+        Client c;
+        c.connectToServer(QUrl("nats://localhost:4222"));
+        auto js = c.jetStream();
+
+        QByteArray content;
+        for (int i = 0; i < 100000; i++) {
+            content += QByteArray::number(i);
+        }
+        QBuffer source(&content);
+        source.open(QIODevice::ReadOnly);
+        StreamOptions options;
+        options.chunkSize = 16 * 1024;
+        QCOMPARE(js->publishStream("test.transfer", &source, options), qint64(content.size()));
+
+        // read it back from the stream
+        QBuffer sink;
+        sink.open(QIODevice::WriteOnly);
+        auto receiver = js->receiveStream("MY_STREAM", "test.transfer", &sink);
+        qint64 received = -1;
+        connect(receiver, &StreamReceiver::finished, [&received](qint64 size) { received = size; });
+        QTRY_COMPARE(received, qint64(content.size()));
+        QVERIFY(sink.data() == content);
+    }
+    catch (const QException& e) {
+        QFAIL(e.what());
+    }
+}
+
 void JetStreamTestCase::pushSubscribe()
 {
     try {
@@ -154,6 +714,25 @@ void JetStreamTestCase::pushSubscribe()
             QCOMPARE(m.data, "hello JS again");
             QCOMPARE(m.subject, "test.push");
         }
+
+        // pushed messages can be acknowledged asynchronously too
+        natsCli.start("nats", QStringList() << "consumer" << "add" << "MY_STREAM" << "PUSH_ACK_CONSUMER" << "--config=push_ack_consumer_config.json");
+        natsCli.waitForFinished();
+
+        auto ackSub = js->subscribe("test.pushack", "MY_STREAM", "PUSH_ACK_CONSUMER");
+        QList<QFuture<void>> acks;
+        connect(ackSub, &Subscription::received, [&acks](const Message& message) {
+            acks += Message(message).ackAsync();
+        });
+
+        natsCli.start("nats", QStringList() << "publish" << "--count=5" << "test.pushack" << "ack me");
+        natsCli.waitForFinished();
+
+        QTRY_COMPARE(acks.size(), 5);
+        for (QFuture<void> f : acks) {
+            f.waitForFinished();
+        }
+        QTRY_COMPARE(ackPending(js, "PUSH_ACK_CONSUMER"), 0);
     }
     catch (const QException& e) {
         QFAIL(e.what());